@@ -0,0 +1,42 @@
+"""
+Summary statistics shared by the bench scripts.
+"""
+
+###############################################################################
+# Copyright (C) 2010-2018 David Boyce
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation; either version 3 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+#
+# You may have received a copy of the GNU General Public License along with
+# this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+
+
+import collections
+
+
+def percentile(values, pct):
+    """Nearest-rank percentile of sorted values."""
+    rank = max(1, -(-len(values) * pct // 100))
+    return values[int(rank) - 1]
+
+
+def summarize(samples):
+    """Reduce a list of numbers to its distribution."""
+    values = sorted(samples)
+    if not values:
+        return None
+    return collections.OrderedDict([
+        ('median', percentile(values, 50)),
+        ('p90', percentile(values, 90)),
+        ('p99', percentile(values, 99)),
+        ('min', values[0]),
+        ('max', values[-1]),
+    ])
@@ -0,0 +1,315 @@
+/******************************************************************************
+ * Copyright (C) 2010-2018 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Run the audit engine over an in-memory filesystem (pma_memfs) to
+ * measure priming and classification without a disk, and to see how
+ * each kind of atime handling and timestamp granularity affects the
+ * results.
+ *
+ * For each scenario a tree of files is made and primed, then a fixed
+ * pseudo-random share of the files is read, written, or written and
+ * read again, and new files are added. The tree is rescanned and the
+ * diff classified. Expected and found counts per category are given
+ * along with timings as one JSON object, which also names the
+ * classification kernel in use ($PMAUDIT_SIMD picks another, to
+ * compare). Exits nonzero if a scenario
+ * with nanosecond timestamps and atime updates misclassifies a file.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../libpmaudit.h"
+
+typedef struct {
+    const char *name;
+    pma_atime_t mode;
+    long gran;
+    int exact;                  // must classify every file correctly
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {"relatime", PMA_RELATIME, 1, 1},
+    {"strictatime", PMA_STRICTATIME, 1, 1},
+    {"noatime", PMA_NOATIME, 1, 0},
+    {"coarse", PMA_RELATIME, 1000000000L, 0},
+};
+
+static const char *categories[] = {"unused", "prereqs", "intermediates",
+    "finals"};
+
+static const char *prog = "memfsbench";
+
+static unsigned flags;          // for every snapshot
+static size_t budget;
+
+static void
+insist(int success, const char *term)
+{
+    if (!success) {
+        fprintf(stderr, "%s: Error: %s: %s\n", prog, term, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A fixed scramble of i into [0, 1000000), for choosing what to touch.
+static unsigned
+pick(uint64_t i)
+{
+    i = (i ^ (i >> 33)) * 0xff51afd7ed558ccdULL;
+    i = (i ^ (i >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return (i ^ (i >> 33)) % 1000000;
+}
+
+static void
+file_path(char *buf, size_t size, unsigned long i, unsigned long per_dir)
+{
+    snprintf(buf, size, "d%05lx/f%07lx.c", i / per_dir, i);
+}
+
+/*
+ * Returns 0 if the scenario came out as it must, 1 if not.
+ */
+static int
+run(const scenario_t *sc, unsigned long nfiles, unsigned long per_dir,
+        unsigned read_ppm, unsigned write_ppm, FILE *out)
+{
+    unsigned long expect[4] = {0}, got[4] = {0}, i, nnew;
+    uint64_t start, prime_ns, work_ns, rescan_ns, classify_ns;
+    const char *probe = "ok";
+    pma_snapshot_t *s;
+    pma_counters_t ctr;
+    pma_hooks_t hooks;
+    pma_memfs_t *m;
+    pma_fsops_t ops;
+    pma_diff_t d;
+    size_t cursor;
+    char path[64];
+    unsigned p;
+    int c, bad = 0;
+
+    insist((m = pma_memfs_new(sc->mode, sc->gran)) != NULL, "pma_memfs_new()");
+    for (i = 0; i < nfiles; i++) {
+        file_path(path, sizeof(path), i, per_dir);
+        insist(pma_memfs_write(m, path, 100) != -1, path);
+    }
+    // Let the tree age a little, as a checkout would.
+    pma_memfs_advance(m, 2 * (sc->gran > 1000000000L ? sc->gran : 1000000000L));
+
+    insist((s = pma_snapshot_new()) != NULL, "pma_snapshot_new()");
+    pma_memfs_fsops(m, &ops);
+    insist(pma_set_fsops(s, &ops) != -1, pma_error(s));
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.size = sizeof(hooks);
+    hooks.arg = m;
+    hooks.hash = pma_memfs_hash;
+    insist(pma_set_hooks(s, &hooks) != -1, pma_error(s));
+    pma_set_flags(s, flags);
+    insist(pma_set_budget(s, budget) != -1, pma_error(s));
+    insist(pma_watch(s, ".") != -1, pma_error(s));
+    start = monotonic_ns();
+    if (pma_prime(s) == -1) {
+        // Carry on regardless, to show what would be missed.
+        probe = pma_error(s);
+        pma_set_flags(s, flags | PMA_NOPROBE);
+        start = monotonic_ns();
+        if (pma_prime(s) == -1) {
+            fprintf(stderr, "%s: %s\n", prog, pma_error(s));
+            exit(EXIT_FAILURE);
+        }
+    }
+    prime_ns = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    for (i = 0; i < nfiles; i++) {
+        file_path(path, sizeof(path), i, per_dir);
+        p = pick(i);
+        if (p < read_ppm) {
+            insist(pma_memfs_read(m, path) != -1, path);
+            expect[PMA_PREREQ]++;
+        } else if (p < read_ppm + write_ppm) {
+            insist(pma_memfs_write(m, path, 200) != -1, path);
+            expect[PMA_FINAL]++;
+        } else if (p < read_ppm + 2 * write_ppm) {
+            insist(pma_memfs_write(m, path, 200) != -1, path);
+            insist(pma_memfs_read(m, path) != -1, path);
+            expect[PMA_INTERMEDIATE]++;
+        } else {
+            expect[PMA_UNUSED]++;
+        }
+    }
+    nnew = (uint64_t)nfiles * write_ppm / 1000000;
+    for (i = 0; i < nnew; i++) {
+        snprintf(path, sizeof(path), "new/f%07lx.o", i);
+        insist(pma_memfs_write(m, path, 300) != -1, path);
+        expect[PMA_FINAL]++;
+    }
+    work_ns = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    insist(pma_rescan(s) != -1, pma_error(s));
+    rescan_ns = monotonic_ns() - start;
+    start = monotonic_ns();
+    for (cursor = 0; pma_diff_next(s, &cursor, &d); ) {
+        got[d.category]++;
+    }
+    classify_ns = monotonic_ns() - start;
+    pma_get_counters(s, &ctr);
+
+    fprintf(out, "    \"%s\": {\n", sc->name);
+    fprintf(out, "      \"granularity_ns\": %ld,\n", sc->gran);
+    fprintf(out, "      \"probe\": \"%s\",\n", probe);
+    fprintf(out, "      \"files\": %lu,\n", nfiles + nnew);
+    fprintf(out, "      \"prime_ns\": %llu,\n", (unsigned long long)prime_ns);
+    fprintf(out, "      \"workload_ns\": %llu,\n", (unsigned long long)work_ns);
+    fprintf(out, "      \"rescan_ns\": %llu,\n", (unsigned long long)rescan_ns);
+    fprintf(out, "      \"classify_ns\": %llu,\n",
+            (unsigned long long)classify_ns);
+    fprintf(out, "      \"files_per_sec\": %.0f,\n", (nfiles + nnew) * 1e9 /
+            (rescan_ns + classify_ns ? rescan_ns + classify_ns : 1));
+    fprintf(out, "      \"snapshot_bytes\": %zu,\n", ctr.memory);
+    for (c = 0; c < 2; c++) {
+        unsigned long *counts = c ? got : expect;
+        int k;
+
+        fprintf(out, "      \"%s\": {", c ? "found" : "expected");
+        for (k = 0; k < 4; k++) {
+            fprintf(out, "%s\"%s\": %lu", k ? ", " : "", categories[k],
+                    counts[k]);
+        }
+        fprintf(out, "},\n");
+    }
+    bad = memcmp(expect, got, sizeof(got)) != 0;
+    fprintf(out, "      \"exact\": %s\n", bad ? "false" : "true");
+    fprintf(out, "    }");
+
+    pma_snapshot_free(s);
+    pma_memfs_free(m);
+    return bad && sc->exact;
+}
+
+static void
+usage(int rc)
+{
+    FILE *f = (rc == EXIT_SUCCESS) ? stdout : stderr;
+    const char *fmt = "   %-18s %s\n";
+
+    fprintf(f, "Usage: %s [-i] [-b bytes] [-n files] [-d per-dir] [-r ppm] [-w ppm]"
+            " [scenario...]\n", prog);
+    fprintf(f, fmt, "-h/--help", "Print this usage summary");
+    fprintf(f, fmt, "-b/--budget", "Spill snapshots past this many bytes"
+            " (pma_set_budget)");
+    fprintf(f, fmt, "-i/--inode-order", "Walk as for a cold cache"
+            " (PMA_COLDCACHE)");
+    fprintf(f, fmt, "-n/--files", "Files in the tree (default 1000000)");
+    fprintf(f, fmt, "-d/--per-dir", "Files per directory (default 1000)");
+    fprintf(f, fmt, "-r/--read", "Files per million read (default 100000)");
+    fprintf(f, fmt, "-w/--write", "Files per million written, and as many"
+            " written then read (default 20000)");
+    fprintf(f, "\nScenarios: relatime, strictatime, noatime, coarse"
+            " (default all)\n");
+    exit(rc);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static struct option long_opts[] = {
+        {"files", required_argument, NULL, 'n'},
+        {"per-dir", required_argument, NULL, 'd'},
+        {"read", required_argument, NULL, 'r'},
+        {"write", required_argument, NULL, 'w'},
+        {"budget", required_argument, NULL, 'b'},
+        {"inode-order", no_argument, NULL, 'i'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    unsigned long nfiles = 1000000, per_dir = 1000;
+    unsigned read_ppm = 100000, write_ppm = 20000;
+    size_t i, first = 1;
+    int c, rc = 0;
+
+    while ((c = getopt_long(argc, argv, "b:d:hin:r:w:", long_opts, NULL)) != -1) {
+        switch (c) {
+            case 'd':
+                per_dir = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                budget = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                flags |= PMA_COLDCACHE;
+                break;
+            case 'n':
+                nfiles = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                read_ppm = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                write_ppm = strtoul(optarg, NULL, 0);
+                break;
+            case 'h':
+                usage(EXIT_SUCCESS);
+                break;
+            default:
+                usage(EXIT_FAILURE);
+        }
+    }
+    if (!per_dir || read_ppm + 2 * write_ppm > 1000000) {
+        usage(EXIT_FAILURE);
+    }
+
+    printf("{\n  \"kernel\": \"%s\",\n", pma_classify_kernel());
+    printf("  \"scenarios\": {\n");
+    for (i = 0; i < sizeof(scenarios) / sizeof(*scenarios); i++) {
+        int j, want = optind == argc;
+
+        for (j = optind; j < argc; j++) {
+            want |= !strcmp(argv[j], scenarios[i].name);
+        }
+        if (!want) {
+            continue;
+        }
+        if (!first) {
+            printf(",\n");
+        }
+        first = 0;
+        rc |= run(&scenarios[i], nfiles, per_dir, read_ppm, write_ppm, stdout);
+        fflush(stdout);
+    }
+    printf("\n  }\n}\n");
+    return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// vim: ts=8:sw=4:tw=80:et:
@@ -0,0 +1,2595 @@
+/******************************************************************************
+ * Copyright (C) 2010-2018 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON_KERNEL
+#include <arm_neon.h>
+#endif
+
+#include "libpmaudit.h"
+
+#define SNAP_MAGIC "pmaudit-snapshot 1"
+
+#define ARENA_BLOCK (64 * 1024)
+
+// Classification packs this many entries at a time; a multiple of 64.
+#define CLASSIFY_CHUNK 512
+
+// Index of the bitmap of all entries present at the rescan.
+#define CAT_ANY 4
+
+// Buffer size per spill file, and so the cost of each run merged.
+#define SPILL_BUF (64 * 1024)
+
+// Most runs merged at once, whatever the budget, to spare descriptors.
+#define SPILL_FANIN 64
+
+// Smallest budget, below which runs would hold too few entries.
+#define SPILL_MIN (1024 * 1024)
+
+// Entry flags.
+#define E_BEFORE    0x01    // recorded in the pre-state
+#define E_AFTER     0x02    // present at the last rescan
+#define E_READ      0x04    // seen read at a checkpoint
+#define E_NOTED     0x08    // read reported by a nested audit
+#define E_CHANGED   0x10    // modified within a timestamp granule
+
+typedef struct {
+    const char *path;
+    struct timespec before[2];
+    struct timespec after[2];
+    struct timespec mark;       // mtime as of the last checkpoint
+    off_t size_before;
+    off_t size;
+    unsigned char *prehash;
+    unsigned short root;
+    unsigned short rel;         // path + rel is relative to the root
+    unsigned char flags;
+    unsigned char hashlen;
+} entry_t;
+
+typedef struct {
+    char *dir;                  // as given
+    char *disp;                 // how paths below it begin, "" for "."
+    char *abs;                  // resolved, for talking to other audits
+    size_t rel;
+    dev_t dev;
+} root_t;
+
+typedef struct arena {
+    struct arena *next;
+    size_t used, size;
+    char buf[];
+} arena_t;
+
+typedef struct {
+    FILE *f;
+    unsigned level;             // merges it has been through
+} run_t;
+
+typedef struct {
+    run_t *r;
+    size_t n, cap;
+} runs_t;
+
+typedef int (*visit_fn)(pma_snapshot_t *s, size_t r, const char *path,
+        const struct stat *sb, void *arg);
+
+struct pma_snapshot {
+    root_t *roots;
+    size_t nroots;
+    char **excl;                // name patterns
+    size_t nexcl;
+    char **exclpath;            // absolute paths
+    size_t nexclpath;
+    entry_t *ents;
+    size_t nents, capents;
+    entry_t *adds;              // found by a scan, not yet in ents
+    size_t nadds, capadds;
+    char **noted;
+    size_t nnoted, capnoted;
+    int noted_sorted;
+    pma_hooks_t hooks;
+    pma_fsops_t fs;
+    unsigned flags;
+    long gran;
+    int gran_set;
+    int primed;
+    int rescanned;
+    struct timespec walk_start;
+    struct timespec reftime;
+    size_t files_before;
+    unsigned ambiguous, changed;
+    arena_t *arena;
+    char *abuf;                 // scratch for absolute paths
+    size_t abufsz;
+    pma_counters_t ctr;
+    uint64_t *cats;             // per-category bitmaps over ents
+    size_t catwords, capcats;
+    int classified;             // cats are up to date
+    size_t budget;              // bytes of memory, 0 for no limit
+    size_t held;                // bytes of paths and prehashes held
+    runs_t pre, post;           // sorted runs spilled under a budget
+    FILE *diff;                 // and the diff of the two
+    size_t dpos;                // where the diff was last read to
+    char *dpath;
+    size_t dpathsz;
+    size_t nafter;              // files in the diff
+    char err[PATH_MAX + 256];
+};
+
+static int
+fail(pma_snapshot_t *s, const char *term)
+{
+    snprintf(s->err, sizeof(s->err), "%s: %s", term, strerror(errno));
+    return -1;
+}
+
+static int
+failmsg(pma_snapshot_t *s, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(s->err, sizeof(s->err), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+static int
+tscmp(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec) {
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    }
+    return a->tv_nsec < b->tv_nsec ? -1 : a->tv_nsec > b->tv_nsec;
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+entcmp(const void *pa, const void *pb)
+{
+    return strcmp(((const entry_t *)pa)->path, ((const entry_t *)pb)->path);
+}
+
+static int
+strvcmp(const void *pa, const void *pb)
+{
+    return strcmp(*(char *const *)pa, *(char *const *)pb);
+}
+
+/*
+ * Paths live in an arena freed with the snapshot since entries are
+ * never removed individually.
+ */
+static const char *
+arena_strdup(pma_snapshot_t *s, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    arena_t *a = s->arena;
+    char *copy;
+
+    if (!a || a->size - a->used < len) {
+        size_t size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+
+        if (!(a = malloc(sizeof(arena_t) + size))) {
+            return NULL;
+        }
+        a->next = s->arena;
+        a->used = 0;
+        a->size = size;
+        s->arena = a;
+        s->held += sizeof(arena_t) + size;
+    }
+    copy = a->buf + a->used;
+    memcpy(copy, str, len);
+    a->used += len;
+    return copy;
+}
+
+static int
+grow(void **vec, size_t *cap, size_t need, size_t elsize)
+{
+    void *p;
+    size_t ncap;
+
+    if (need <= *cap) {
+        return 0;
+    }
+    ncap = *cap ? *cap * 2 : 1024;
+    while (ncap < need) {
+        ncap *= 2;
+    }
+    if (!(p = realloc(*vec, ncap * elsize))) {
+        return -1;
+    }
+    *vec = p;
+    *cap = ncap;
+    return 0;
+}
+
+static void
+runs_close(runs_t *runs)
+{
+    size_t i;
+
+    for (i = 0; i < runs->n; i++) {
+        fclose(runs->r[i].f);
+    }
+    free(runs->r);
+    memset(runs, 0, sizeof(*runs));
+}
+
+/*
+ * The POSIX filesystem operations.
+ */
+static void *
+posix_opendir(void *arg, const char *path)
+{
+    (void)arg;
+    return opendir(path);
+}
+
+static const char *
+posix_readdir(void *arg, void *dir, ino_t *ino)
+{
+    struct dirent *de;
+
+    (void)arg;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] != '.' || (de->d_name[1] != '\0' &&
+                    (de->d_name[1] != '.' || de->d_name[2] != '\0'))) {
+            *ino = de->d_ino;
+            return de->d_name;
+        }
+    }
+    return NULL;
+}
+
+static void
+posix_closedir(void *arg, void *dir)
+{
+    (void)arg;
+    closedir(dir);
+}
+
+static int
+posix_stat(void *arg, void *dir, const char *name, struct stat *sb, int follow)
+{
+    (void)arg;
+    return fstatat(dir ? dirfd((DIR *)dir) : AT_FDCWD, name, sb,
+            follow ? 0 : AT_SYMLINK_NOFOLLOW);
+}
+
+static int
+posix_set_times(void *arg, const char *path, const struct timespec times[2])
+{
+    (void)arg;
+    return utimensat(AT_FDCWD, path, times, 0);
+}
+
+static int
+posix_create(void *arg, const char *path)
+{
+    static const char data[] = "data\n";
+    int fd, rc;
+
+    (void)arg;
+    if ((fd = open(path, O_CREAT|O_WRONLY|O_EXCL, 0644)) == -1) {
+        return -1;
+    }
+    rc = write(fd, data, sizeof(data) - 1) == -1 ? -1 : 0;
+    close(fd);
+    return rc;
+}
+
+static int
+posix_read(void *arg, const char *path)
+{
+    char buf[64];
+    int fd, rc;
+
+    (void)arg;
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return -1;
+    }
+    rc = read(fd, buf, sizeof(buf)) == -1 ? -1 : 0;
+    close(fd);
+    return rc;
+}
+
+static int
+posix_unlink(void *arg, const char *path)
+{
+    (void)arg;
+    return unlink(path);
+}
+
+static char *
+posix_realpath(void *arg, const char *path)
+{
+    (void)arg;
+    return realpath(path, NULL);
+}
+
+static void
+posix_now(void *arg, struct timespec *ts)
+{
+    (void)arg;
+    clock_gettime(CLOCK_REALTIME, ts);
+}
+
+static const pma_fsops_t posix_fsops = {
+    sizeof(pma_fsops_t), NULL, posix_opendir, posix_readdir, posix_closedir, posix_stat,
+    posix_set_times, posix_create, posix_read, posix_unlink, posix_realpath,
+    posix_now
+};
+
+pma_snapshot_t *
+pma_snapshot_new(void)
+{
+    pma_snapshot_t *s;
+
+    if (!(s = calloc(1, sizeof(*s)))) {
+        return NULL;
+    }
+    s->gran = 1;
+    s->fs = posix_fsops;
+    return s;
+}
+
+void
+pma_snapshot_free(pma_snapshot_t *s)
+{
+    arena_t *a;
+    size_t i;
+
+    if (!s) {
+        return;
+    }
+    for (i = 0; i < s->nroots; i++) {
+        free(s->roots[i].dir);
+        free(s->roots[i].disp);
+        free(s->roots[i].abs);
+    }
+    free(s->roots);
+    for (i = 0; i < s->nexcl; i++) {
+        free(s->excl[i]);
+    }
+    free(s->excl);
+    for (i = 0; i < s->nexclpath; i++) {
+        free(s->exclpath[i]);
+    }
+    free(s->exclpath);
+    for (i = 0; i < s->nents; i++) {
+        free(s->ents[i].prehash);
+    }
+    free(s->ents);
+    free(s->cats);
+    free(s->adds);
+    for (i = 0; i < s->nnoted; i++) {
+        free(s->noted[i]);
+    }
+    free(s->noted);
+    while ((a = s->arena)) {
+        s->arena = a->next;
+        free(a);
+    }
+    free(s->abuf);
+    runs_close(&s->pre);
+    runs_close(&s->post);
+    if (s->diff) {
+        fclose(s->diff);
+    }
+    free(s->dpath);
+    free(s);
+}
+
+const char *
+pma_error(const pma_snapshot_t *s)
+{
+    return s->err;
+}
+
+void
+pma_set_flags(pma_snapshot_t *s, unsigned flags)
+{
+    s->flags = flags;
+}
+
+int
+pma_set_hooks(pma_snapshot_t *s, const pma_hooks_t *hooks)
+{
+    if (hooks->size != sizeof(pma_hooks_t)) {
+        return failmsg(s, "pma_set_hooks: size %zu, expected %zu",
+                hooks->size, sizeof(pma_hooks_t));
+    }
+    s->hooks = *hooks;
+    return 0;
+}
+
+int
+pma_set_fsops(pma_snapshot_t *s, const pma_fsops_t *ops)
+{
+    if (ops && ops->size != sizeof(pma_fsops_t)) {
+        return failmsg(s, "pma_set_fsops: size %zu, expected %zu",
+                ops->size, sizeof(pma_fsops_t));
+    }
+    s->fs = ops ? *ops : posix_fsops;
+    return 0;
+}
+
+int
+pma_set_budget(pma_snapshot_t *s, size_t bytes)
+{
+    if (s->primed) {
+        return failmsg(s, "pma_set_budget: already primed");
+    }
+    s->budget = bytes && bytes < SPILL_MIN ? SPILL_MIN : bytes;
+    return 0;
+}
+
+void
+pma_set_granularity(pma_snapshot_t *s, long ns)
+{
+    s->gran = ns > 0 ? ns : 1;
+    s->gran_set = 1;
+}
+
+// Add str, which is taken over, to a list of strings.
+static int
+strv_add(pma_snapshot_t *s, char ***vec, size_t *n, char *str,
+        const char *term)
+{
+    char **v;
+
+    if (!str || !(v = realloc(*vec, (*n + 1) * sizeof(char *)))) {
+        free(str);
+        return fail(s, term);
+    }
+    v[(*n)++] = str;
+    *vec = v;
+    return 0;
+}
+
+int
+pma_exclude(pma_snapshot_t *s, const char *pattern)
+{
+    return strv_add(s, &s->excl, &s->nexcl, strdup(pattern), "pma_exclude");
+}
+
+int
+pma_exclude_path(pma_snapshot_t *s, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir, *abs, *full;
+    int rc;
+
+    // The file itself may not exist yet, so resolve only its directory.
+    if (!(dir = slash ? strndup(path, slash - path + !(slash - path)) :
+                strdup("."))) {
+        return fail(s, "pma_exclude_path");
+    }
+    abs = s->fs.realpath(s->fs.arg, dir);
+    free(dir);
+    if (!abs) {
+        return fail(s, path);
+    }
+    rc = asprintf(&full, "%s%s%s", abs, strcmp(abs, "/") ? "/" : "",
+            slash ? slash + 1 : path);
+    free(abs);
+    if (rc == -1) {
+        return fail(s, "pma_exclude_path");
+    }
+    return strv_add(s, &s->exclpath, &s->nexclpath, full, "pma_exclude_path");
+}
+
+int
+pma_watch(pma_snapshot_t *s, const char *dir)
+{
+    root_t *roots, *r;
+    const char *d = dir;
+    size_t len;
+
+    if (!(roots = realloc(s->roots, (s->nroots + 1) * sizeof(root_t)))) {
+        return fail(s, "pma_watch");
+    }
+    s->roots = roots;
+    r = &roots[s->nroots];
+    memset(r, 0, sizeof(*r));
+    if (!(r->abs = s->fs.realpath(s->fs.arg, dir))) {
+        return fail(s, dir);
+    }
+    // Name files as nftw would with a leading "./" dropped.
+    while (d[0] == '.' && d[1] == '/') {
+        for (d += 2; *d == '/'; d++);
+    }
+    len = strlen(d);
+    while (len > 1 && d[len - 1] == '/') {
+        len--;
+    }
+    if (!strcmp(d, ".") || len == 0) {
+        len = 0;
+    }
+    r->dir = strdup(dir);
+    r->disp = strndup(d, len);
+    if (!r->dir || !r->disp) {
+        free(r->dir);
+        free(r->disp);
+        free(r->abs);
+        return fail(s, "pma_watch");
+    }
+    r->rel = len ? len + (r->disp[len - 1] != '/') : 0;
+    s->nroots++;
+    return 0;
+}
+
+/*
+ * Whether path, below root r, has an excluded name or is an excluded
+ * path. Only the last component is matched since a walk doesn't enter
+ * directories with excluded names.
+ */
+static int
+excluded(const pma_snapshot_t *s, size_t r, const char *path)
+{
+    const root_t *root = &s->roots[r];
+    const char *name = strrchr(path, '/');
+    size_t alen, i;
+
+    name = name ? name + 1 : path;
+    for (i = 0; i < s->nexcl; i++) {
+        if (!fnmatch(s->excl[i], name, 0)) {
+            return 1;
+        }
+    }
+    alen = strcmp(root->abs, "/") ? strlen(root->abs) : 0;
+    for (i = 0; i < s->nexclpath; i++) {
+        if (!strncmp(s->exclpath[i], root->abs, alen) &&
+                s->exclpath[i][alen] == '/' &&
+                !strcmp(s->exclpath[i] + alen + 1, path + root->rel)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Entries of a directory, for visiting in inode order.
+typedef struct {
+    ino_t ino;
+    size_t name;                // offset into the names
+    struct stat sb;
+    int kind;
+} dent_t;
+
+static int
+dentcmp(const void *a, const void *b)
+{
+    ino_t x = ((const dent_t *)a)->ino, y = ((const dent_t *)b)->ino;
+
+    return x < y ? -1 : x > y;
+}
+
+// Put name after the directory's path in buf.
+static int
+set_name(pma_snapshot_t *s, char **buf, size_t *cap, size_t len, size_t base,
+        const char *name)
+{
+    size_t nlen = strlen(name);
+
+    if (grow((void **)buf, cap, base + nlen + 1, 1) == -1) {
+        return fail(s, "walk");
+    }
+    if (base > len) {
+        (*buf)[len] = '/';
+    }
+    memcpy(*buf + base, name, nlen + 1);
+    return 0;
+}
+
+/*
+ * Stat an entry of dir, whose path is in path, and say what a walk
+ * should do with it: 0 pass it by, 1 visit it, 2 descend into it.
+ */
+static int
+walk_kind(pma_snapshot_t *s, size_t r, void *dir, const char *name,
+        const char *path, struct stat *sb)
+{
+    int islink;
+
+    if (excluded(s, r, path) || (s->ctr.stats++,
+            s->fs.stat(s->fs.arg, dir, name, sb, 0) == -1)) {
+        return 0;
+    }
+    if ((islink = S_ISLNK(sb->st_mode)) && (s->ctr.stats++,
+                s->fs.stat(s->fs.arg, dir, name, sb, 1) == -1)) {
+        return 0;
+    }
+    if (S_ISDIR(sb->st_mode)) {
+        return !islink && sb->st_dev == s->roots[r].dev ? 2 : 0;
+    }
+    return S_ISREG(sb->st_mode) ? 1 : 0;
+}
+
+static int walk_dir(pma_snapshot_t *s, size_t r, char **buf, size_t *cap,
+        size_t len, visit_fn fn, void *arg);
+
+/*
+ * For PMA_COLDCACHE: read the whole directory, stat its entries in
+ * inode order so that uncached inodes come off the disk in sequence,
+ * and only then visit.
+ */
+static int
+walk_sorted(pma_snapshot_t *s, size_t r, char **buf, size_t *cap, size_t len,
+        size_t base, void *dir, visit_fn fn, void *arg)
+{
+    dent_t *ents = NULL;
+    char *names = NULL;
+    const char *name;
+    size_t n = 0, capents = 0, nused = 0, capnames = 0, nlen, i;
+    ino_t ino;
+    int rc = 0;
+
+    while ((name = s->fs.readdir(s->fs.arg, dir, &ino))) {
+        nlen = strlen(name) + 1;
+        if (grow((void **)&ents, &capents, n + 1, sizeof(dent_t)) == -1 ||
+                grow((void **)&names, &capnames, nused + nlen, 1) == -1) {
+            rc = fail(s, "walk");
+            break;
+        }
+        ents[n].ino = ino;
+        ents[n++].name = nused;
+        memcpy(names + nused, name, nlen);
+        nused += nlen;
+    }
+    if (!rc) {
+        qsort(ents, n, sizeof(dent_t), dentcmp);
+    }
+    for (i = 0; !rc && i < n; i++) {
+        name = names + ents[i].name;
+        if (!(rc = set_name(s, buf, cap, len, base, name))) {
+            ents[i].kind = walk_kind(s, r, dir, name, *buf, &ents[i].sb);
+        }
+    }
+    for (i = 0; !rc && i < n; i++) {
+        if (!ents[i].kind || (rc = set_name(s, buf, cap, len, base,
+                        names + ents[i].name))) {
+            continue;
+        }
+        if (ents[i].kind == 2) {
+            rc = walk_dir(s, r, buf, cap, base + strlen(names + ents[i].name),
+                    fn, arg);
+        } else {
+            s->ctr.files++;
+            rc = fn(s, r, *buf, &ents[i].sb, arg);
+        }
+    }
+    free(ents);
+    free(names);
+    return rc;
+}
+
+/*
+ * A physical walk like nftw(FTW_MOUNT) but with the snapshot in hand.
+ * Symlinks to files are followed, symlinks to directories are not,
+ * and directories whose names are excluded aren't entered at all.
+ */
+static int
+walk_dir(pma_snapshot_t *s, size_t r, char **buf, size_t *cap, size_t len,
+        visit_fn fn, void *arg)
+{
+    const char *name;
+    struct stat sb;
+    size_t base;
+    void *dir;
+    ino_t ino;
+    int kind, rc = 0;
+
+    s->ctr.opens++;
+    if (!(dir = s->fs.opendir(s->fs.arg, len ? *buf : "."))) {
+        return 0;
+    }
+    s->ctr.dirs++;
+    base = len ? len + ((*buf)[len - 1] != '/') : 0;
+    if (s->flags & PMA_COLDCACHE) {
+        rc = walk_sorted(s, r, buf, cap, len, base, dir, fn, arg);
+    } else {
+        while (!rc && (name = s->fs.readdir(s->fs.arg, dir, &ino))) {
+            if ((rc = set_name(s, buf, cap, len, base, name)) ||
+                    !(kind = walk_kind(s, r, dir, name, *buf, &sb))) {
+                continue;
+            }
+            if (kind == 2) {
+                rc = walk_dir(s, r, buf, cap, base + strlen(name), fn, arg);
+            } else {
+                s->ctr.files++;
+                rc = fn(s, r, *buf, &sb, arg);
+            }
+        }
+    }
+    s->fs.closedir(s->fs.arg, dir);
+    (*buf)[len] = '\0';
+    return rc;
+}
+
+static int
+walk(pma_snapshot_t *s, visit_fn fn, void *arg)
+{
+    struct stat sb;
+    size_t r, cap = PATH_MAX;
+    char *buf;
+    int rc = 0;
+
+    s->classified = 0;
+    if (!(buf = malloc(cap))) {
+        return fail(s, "walk");
+    }
+    for (r = 0; !rc && r < s->nroots; r++) {
+        s->ctr.stats++;
+        if (s->fs.stat(s->fs.arg, NULL, s->roots[r].dir, &sb, 1) == -1) {
+            rc = fail(s, s->roots[r].dir);
+            break;
+        }
+        s->roots[r].dev = sb.st_dev;
+        strcpy(buf, s->roots[r].disp);
+        rc = walk_dir(s, r, &buf, &cap, strlen(buf), fn, arg);
+    }
+    free(buf);
+    return rc;
+}
+
+/*
+ * External-memory snapshots. Under a memory budget (pma_set_budget())
+ * entries are held only until they'd fill half of it, then sorted and
+ * spilled as a run to an unlinked temp file. The pre-state and the
+ * post-state each become a set of runs, merged down to a bounded
+ * number, and the diff is an external merge-join of the two written
+ * to a temp file of its own which pma_diff_next() reads back.
+ */
+
+// A spilled entry, followed by its path (without NUL) and prehash.
+typedef struct {
+    int64_t times[2];           // atime, mtime in ns
+    int64_t size;
+    uint32_t pathlen;
+    uint16_t root;
+    uint8_t hashlen;
+} srec_t;
+
+// A diff record, followed by its path.
+typedef struct {
+    int64_t times[4];           // before atime, mtime; after atime, mtime
+    int64_t size;
+    uint32_t pathlen;
+    uint8_t category;
+    uint8_t flags;              // PMA_DIFF_*
+} drec_t;
+
+typedef struct {
+    FILE *f;
+    srec_t h;
+    char *path;
+    size_t pathsz;
+    unsigned char hash[PMA_DIGEST_MAX];
+} reader_t;
+
+// Runs merged as one sorted stream, without repeated paths.
+typedef struct {
+    reader_t *rd;
+    size_t *heap;               // readers with a record, least path first
+    size_t n, nheap;
+    char *last;
+    size_t lastsz;
+} merger_t;
+
+static void sort_ents(pma_snapshot_t *s);
+
+static int64_t
+ts_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static struct timespec
+ns_ts(int64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    if (ts.tv_nsec < 0) {
+        ts.tv_sec--;
+        ts.tv_nsec += 1000000000;
+    }
+    return ts;
+}
+
+static FILE *
+spill_open(pma_snapshot_t *s)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    char *path;
+    FILE *f;
+    int fd;
+
+    if (asprintf(&path, "%s/pmaudit.spill.XXXXXX",
+                tmpdir && *tmpdir ? tmpdir : "/tmp") == -1) {
+        fail(s, "spill");
+        return NULL;
+    }
+    s->ctr.opens++;
+    if ((fd = mkstemp(path)) == -1) {
+        fail(s, path);
+        free(path);
+        return NULL;
+    }
+    unlink(path);
+    free(path);
+    if (!(f = fdopen(fd, "w+"))) {
+        fail(s, "spill");
+        close(fd);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, SPILL_BUF);
+    return f;
+}
+
+/*
+ * How many runs to merge at once: as many as half the budget has room
+ * to buffer. Each state keeps at most half that many for the diff.
+ */
+static size_t
+spill_fanin(const pma_snapshot_t *s)
+{
+    size_t fan = s->budget / 2 / SPILL_BUF;
+
+    return fan < 2 ? 2 : fan > SPILL_FANIN ? SPILL_FANIN : fan;
+}
+
+static int merge_tail(pma_snapshot_t *s, runs_t *runs, size_t k);
+
+// True if the entries held should be spilled before adding another.
+static int
+over_budget(const pma_snapshot_t *s)
+{
+    size_t held = s->capents * sizeof(entry_t);
+
+    // Growing the entries means holding old and new at once.
+    if (s->nents == s->capents) {
+        held *= 3;
+    }
+    return s->budget && s->nents && held + s->held > s->budget / 2;
+}
+
+// Sort the entries held and write them out as a run, then drop them.
+static int
+spill_run(pma_snapshot_t *s, runs_t *runs)
+{
+    const entry_t *e;
+    arena_t *a;
+    srec_t h;
+    size_t i, fan;
+    FILE *f;
+    int post = runs == &s->post;
+
+    if (!s->nents) {
+        return 0;
+    }
+    if (grow((void **)&runs->r, &runs->cap, runs->n + 1, sizeof(run_t))) {
+        return fail(s, "spill");
+    }
+    if (!(f = spill_open(s))) {
+        return -1;
+    }
+    runs->r[runs->n].f = f;
+    runs->r[runs->n++].level = 0;
+    sort_ents(s);
+    if (!post) {
+        s->files_before += s->nents;
+    }
+    memset(&h, 0, sizeof(h));
+    for (i = 0; i < s->nents; i++) {
+        e = &s->ents[i];
+        h.times[0] = ts_ns(post ? &e->after[0] : &e->before[0]);
+        h.times[1] = ts_ns(post ? &e->after[1] : &e->before[1]);
+        h.size = post ? e->size : e->size_before;
+        h.pathlen = strlen(e->path);
+        h.root = e->root;
+        h.hashlen = e->hashlen;
+        fwrite(&h, sizeof(h), 1, f);
+        fwrite(e->path, 1, h.pathlen, f);
+        fwrite(e->prehash, 1, e->hashlen, f);
+        free(e->prehash);
+    }
+    s->nents = 0;
+    while ((a = s->arena)) {
+        s->arena = a->next;
+        free(a);
+    }
+    s->held = 0;
+    if (fflush(f) == EOF || ferror(f)) {
+        return fail(s, "spill");
+    }
+
+    // Merge runs of a level once there are enough of them, so that
+    // each entry is rewritten only about log(runs) times.
+    fan = spill_fanin(s);
+    while (runs->n >= fan &&
+            runs->r[runs->n - fan].level == runs->r[runs->n - 1].level) {
+        if (merge_tail(s, runs, fan)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Read the next record of a run: 1 if there was one, 0 at the end.
+static int
+reader_next(pma_snapshot_t *s, reader_t *rd)
+{
+    if (fread(&rd->h, sizeof(rd->h), 1, rd->f) != 1) {
+        return ferror(rd->f) ? fail(s, "spill") : 0;
+    }
+    if (grow((void **)&rd->path, &rd->pathsz, rd->h.pathlen + 1, 1)) {
+        return fail(s, "spill");
+    }
+    if (fread(rd->path, 1, rd->h.pathlen, rd->f) != rd->h.pathlen ||
+            fread(rd->hash, 1, rd->h.hashlen, rd->f) != rd->h.hashlen) {
+        return failmsg(s, "spill: truncated run");
+    }
+    rd->path[rd->h.pathlen] = '\0';
+    return 1;
+}
+
+// Order by path, then by run so the first of a repeated path wins.
+static int
+heap_less(const merger_t *m, size_t a, size_t b)
+{
+    int c = strcmp(m->rd[a].path, m->rd[b].path);
+
+    return c < 0 || (c == 0 && a < b);
+}
+
+static void
+heap_down(merger_t *m, size_t i)
+{
+    size_t kid, tmp;
+
+    while ((kid = 2 * i + 1) < m->nheap) {
+        if (kid + 1 < m->nheap && heap_less(m, m->heap[kid + 1], m->heap[kid])) {
+            kid++;
+        }
+        if (!heap_less(m, m->heap[kid], m->heap[i])) {
+            break;
+        }
+        tmp = m->heap[i];
+        m->heap[i] = m->heap[kid];
+        m->heap[kid] = tmp;
+        i = kid;
+    }
+}
+
+static void
+merger_free(merger_t *m)
+{
+    size_t i;
+
+    for (i = 0; i < m->n; i++) {
+        free(m->rd[i].path);
+    }
+    free(m->rd);
+    free(m->heap);
+    free(m->last);
+    memset(m, 0, sizeof(*m));
+}
+
+static int
+merger_init(pma_snapshot_t *s, merger_t *m, const run_t *runs, size_t n)
+{
+    size_t i;
+    int rc;
+
+    memset(m, 0, sizeof(*m));
+    if (!(m->rd = calloc(n + 1, sizeof(reader_t))) ||
+            !(m->heap = calloc(n + 1, sizeof(size_t)))) {
+        merger_free(m);
+        return fail(s, "spill");
+    }
+    m->n = n;
+    for (i = 0; i < n; i++) {
+        m->rd[i].f = runs[i].f;
+        rewind(runs[i].f);
+        if ((rc = reader_next(s, &m->rd[i])) == -1) {
+            merger_free(m);
+            return -1;
+        }
+        if (rc) {
+            m->heap[m->nheap++] = i;
+        }
+    }
+    for (i = m->nheap / 2; i-- > 0; ) {
+        heap_down(m, i);
+    }
+    return 0;
+}
+
+static reader_t *
+merger_top(merger_t *m)
+{
+    return m->nheap ? &m->rd[m->heap[0]] : NULL;
+}
+
+// Move past the current path in every run that has it.
+static int
+merger_pop(pma_snapshot_t *s, merger_t *m)
+{
+    reader_t *rd;
+    size_t len;
+    int rc;
+
+    len = strlen(merger_top(m)->path) + 1;
+    if (grow((void **)&m->last, &m->lastsz, len, 1)) {
+        return fail(s, "spill");
+    }
+    memcpy(m->last, merger_top(m)->path, len);
+    while ((rd = merger_top(m)) && !strcmp(rd->path, m->last)) {
+        if ((rc = reader_next(s, rd)) == -1) {
+            return -1;
+        }
+        if (!rc) {
+            m->heap[0] = m->heap[--m->nheap];
+        }
+        heap_down(m, 0);
+    }
+    return 0;
+}
+
+// Merge the last k runs into one, keeping their place in the order.
+static int
+merge_tail(pma_snapshot_t *s, runs_t *runs, size_t k)
+{
+    size_t first = runs->n - k, i;
+    unsigned level = 0;
+    merger_t m;
+    reader_t *rd;
+    FILE *out;
+
+    if (!(out = spill_open(s))) {
+        return -1;
+    }
+    if (merger_init(s, &m, runs->r + first, k)) {
+        fclose(out);
+        return -1;
+    }
+    while ((rd = merger_top(&m))) {
+        fwrite(&rd->h, sizeof(rd->h), 1, out);
+        fwrite(rd->path, 1, rd->h.pathlen, out);
+        fwrite(rd->hash, 1, rd->h.hashlen, out);
+        if (merger_pop(s, &m)) {
+            merger_free(&m);
+            fclose(out);
+            return -1;
+        }
+    }
+    merger_free(&m);
+    if (fflush(out) == EOF || ferror(out)) {
+        fclose(out);
+        return fail(s, "spill");
+    }
+    for (i = first; i < runs->n; i++) {
+        fclose(runs->r[i].f);
+        if (runs->r[i].level > level) {
+            level = runs->r[i].level;
+        }
+    }
+    runs->n = first;
+    runs->r[runs->n].f = out;
+    runs->r[runs->n++].level = level + 1;
+    return 0;
+}
+
+// Merge runs, smallest first, down to at most limit of them.
+static int
+reduce_runs(pma_snapshot_t *s, runs_t *runs, size_t limit)
+{
+    size_t fan = spill_fanin(s);
+
+    while (runs->n > limit) {
+        if (merge_tail(s, runs, runs->n - limit + 1 < fan ?
+                    runs->n - limit + 1 : fan)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static const char *
+abspath(pma_snapshot_t *s, const entry_t *e)
+{
+    const root_t *r = &s->roots[e->root];
+    size_t need = strlen(r->abs) + strlen(e->path + e->rel) + 2;
+
+    if (grow((void **)&s->abuf, &s->abufsz, need, 1) == -1) {
+        return NULL;
+    }
+    snprintf(s->abuf, s->abufsz, "%s/%s", r->abs, e->path + e->rel);
+    return s->abuf;
+}
+
+/*
+ * Set a file's atime behind its mtime so that, relatime or not, the
+ * next read will move it. sb is the file's state beforehand.
+ */
+static int
+prime(pma_snapshot_t *s, const char *path, const struct stat *sb,
+        struct timespec times[2])
+{
+    times[0].tv_sec = sb->st_mtime - 1;
+    times[0].tv_nsec = 0L;
+    times[1] = sb->st_mtim;
+    s->ctr.utimes++;
+    if (s->fs.set_times(s->fs.arg, path, times) == -1) {
+        return fail(s, path);
+    }
+    if (s->hooks.retimed) {
+        s->hooks.retimed(s->hooks.arg, path, sb);
+    }
+    return 0;
+}
+
+// Pass a read upward before priming destroys the evidence.
+static void
+report(pma_snapshot_t *s, const entry_t *e)
+{
+    const char *abs;
+
+    if (s->hooks.report && (abs = abspath(s, e))) {
+        s->hooks.report(s->hooks.arg, abs);
+    }
+}
+
+/*
+ * True if a file's mtime is so recent, relative to ref, that a later
+ * write within the same timestamp granule could leave it unchanged.
+ * One granule of slack covers the kernel's coarse file clock lagging
+ * behind the clock ref was read from.
+ */
+static int
+is_racy(const pma_snapshot_t *s, const struct timespec *mtime,
+        const struct timespec *ref)
+{
+    int64_t refns, mns;
+
+    if (s->gran <= 1) {
+        return 0;
+    }
+    refns = (int64_t)ref->tv_sec * 1000000000LL + ref->tv_nsec - s->gran;
+    mns = (int64_t)mtime->tv_sec * 1000000000LL + mtime->tv_nsec;
+    return mns >= refns - refns % s->gran;
+}
+
+/*
+ * Create, read, and remove a temp file to check that atimes are
+ * being updated, and guess the timestamp granularity of the
+ * filesystem in nanoseconds from how round its timestamps are.
+ */
+static int
+probe_atimes(pma_snapshot_t *s, const char *path)
+{
+    long gran;
+    char tmpf[PATH_MAX];
+    struct stat ostats, nstats;
+    struct timespec otimes[2] = {{-1, 0L}, {0, UTIME_OMIT}};
+    const pma_fsops_t *fs = &s->fs;
+
+    snprintf(tmpf, sizeof(tmpf), "%s/audit.%ld.tmp", path, (long)getpid());
+    s->ctr.opens += 2;
+    s->ctr.stats += 2;
+    s->ctr.utimes++;
+    if (fs->create(fs->arg, tmpf) == -1) {
+        return fail(s, tmpf);
+    }
+    if (fs->stat(fs->arg, NULL, tmpf, &ostats, 1) == -1 ||
+            (otimes[0].tv_sec = ostats.st_mtime - 1,
+             fs->set_times(fs->arg, tmpf, otimes) == -1) ||
+            fs->read(fs->arg, tmpf) == -1 ||
+            fs->stat(fs->arg, NULL, tmpf, &nstats, 1) == -1) {
+        fail(s, tmpf);
+        fs->unlink(fs->arg, tmpf);
+        return -1;
+    }
+    if (fs->unlink(fs->arg, tmpf) == -1) {
+        return fail(s, tmpf);
+    }
+    if (tscmp(&nstats.st_atim, &nstats.st_mtim) < 0) {
+        return failmsg(s, "atimes not updated in %s", path);
+    }
+
+    // If all of its timestamps are round, the filesystem keeps no more.
+    if (!s->gran_set) {
+        for (gran = 1000000000L; gran > 1; gran /= 1000) {
+            if (!(ostats.st_mtim.tv_nsec % gran) &&
+                    !(nstats.st_atim.tv_nsec % gran) &&
+                    !(nstats.st_ctim.tv_nsec % gran)) {
+                break;
+            }
+        }
+        s->gran = gran;
+    }
+    return 0;
+}
+
+static int
+prime_visit(pma_snapshot_t *s, size_t r, const char *path,
+        const struct stat *sb, void *arg)
+{
+    unsigned char digest[PMA_DIGEST_MAX];
+    entry_t *e;
+    int c, len;
+
+    (void)arg;
+    if (over_budget(s) && spill_run(s, &s->pre)) {
+        return -1;
+    }
+    if (grow((void **)&s->ents, &s->capents, s->nents + 1, sizeof(entry_t))) {
+        return fail(s, "pma_prime");
+    }
+    e = &s->ents[s->nents];
+    memset(e, 0, sizeof(*e));
+    if (!(e->path = arena_strdup(s, path))) {
+        return fail(s, "pma_prime");
+    }
+    e->root = r;
+    e->rel = s->roots[r].rel;
+    e->flags = E_BEFORE;
+    e->before[0].tv_sec = sb->st_mtime - 1;
+    e->before[1] = e->mark = sb->st_mtim;
+    e->size_before = sb->st_size;
+    s->nents++;
+
+    // With coarse timestamps a write during the command might not move
+    // the mtime of a recently modified file, so fingerprint it. This has
+    // to happen before priming since reading it moves the atime.
+    if (s->hooks.hash && is_racy(s, &sb->st_mtim, &s->walk_start) &&
+            (len = s->hooks.hash(s->hooks.arg, path, digest)) > 0 &&
+            (e->prehash = malloc(len))) {
+        memcpy(e->prehash, digest, len);
+        e->hashlen = len;
+        s->held += len;
+        s->ambiguous++;
+    }
+
+    // Inside an enclosing audit, a file whose atime is still behind its
+    // mtime hasn't been read since that audit primed it and is left
+    // alone; anything read in the meantime is reported before priming.
+    c = (s->flags & PMA_NESTED) ? tscmp(&sb->st_atim, &sb->st_mtim) : 0;
+    if (c < 0) {
+        e->before[0] = sb->st_atim;
+        return 0;
+    }
+    if (c > 0) {
+        report(s, e);
+    }
+    return prime(s, path, sb, e->before);
+}
+
+// Sort the entries, keeping the first of any reached via two roots.
+static void
+sort_ents(pma_snapshot_t *s)
+{
+    size_t i, j;
+
+    s->classified = 0;
+    qsort(s->ents, s->nents, sizeof(entry_t), entcmp);
+    for (i = j = 0; i < s->nents; i++) {
+        if (j && !strcmp(s->ents[j - 1].path, s->ents[i].path)) {
+            free(s->ents[i].prehash);
+            continue;
+        }
+        s->ents[j++] = s->ents[i];
+    }
+    s->nents = j;
+}
+
+int
+pma_prime(pma_snapshot_t *s)
+{
+    uint64_t start = now_ns();
+    size_t r;
+
+    if (s->primed) {
+        return failmsg(s, "pma_prime: already primed");
+    }
+    for (r = 0; r < s->nroots; r++) {
+        if (!(s->flags & PMA_NOPROBE) && probe_atimes(s, s->roots[r].dir)) {
+            return -1;
+        }
+    }
+    s->ctr.probe_ns += now_ns() - start;
+    start = now_ns();
+    s->fs.now(s->fs.arg, &s->walk_start);
+    if (walk(s, prime_visit, NULL)) {
+        return -1;
+    }
+    if (s->budget) {
+        if (spill_run(s, &s->pre) || reduce_runs(s, &s->pre, spill_fanin(s) / 2)) {
+            return -1;
+        }
+    } else {
+        sort_ents(s);
+        s->files_before = s->nents;
+    }
+    s->ctr.prime_ns += now_ns() - start;
+    s->primed = 1;
+    s->fs.now(s->fs.arg, &s->reftime);
+    return 0;
+}
+
+/*
+ * True if the file or directory at path still has the mtime, and the
+ * atime if one is given, recorded for it.
+ */
+static int
+times_match(pma_snapshot_t *s, const char *path, const struct timespec *atime,
+        const struct timespec *mtime)
+{
+    struct stat sb;
+
+    s->ctr.stats++;
+    return s->fs.stat(s->fs.arg, NULL, path, &sb, 1) != -1 &&
+        !tscmp(&sb.st_mtim, mtime) && (!atime || !tscmp(&sb.st_atim, atime));
+}
+
+/*
+ * Take the pre-state from a snapshot file left by another audit if it
+ * covers all of the watched roots, sparing a walk and a round of
+ * priming. Returns 1 if it did, 0 if not.
+ *
+ * Anything run unaudited since the snapshot was saved, such as make
+ * reading a makefile between recipes, would otherwise be charged to
+ * this audit. So the snapshot is only taken if every file in it still
+ * has the times recorded, and every directory the mtime, which costs a
+ * stat apiece but no priming. If not, pma_prime() reports such reads
+ * to the enclosing audit as it should.
+ */
+int
+pma_load(pma_snapshot_t *s, const char *file)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t n = 0, r, rlen, i;
+    ssize_t len;
+    unsigned char *covered;
+    long as, an, ms, mn;
+    long long size;
+    int off, all = 0, rc = 0;
+    uint64_t start = now_ns();
+    entry_t *e;
+
+    if (s->primed) {
+        return failmsg(s, "pma_load: already primed");
+    }
+    if (s->budget) {
+        return failmsg(s, "pma_load: not with a memory budget");
+    }
+    s->ctr.opens++;
+    if (!(f = fopen(file, "r"))) {
+        return errno == ENOENT ? 0 : fail(s, file);
+    }
+    if (!(covered = calloc(s->nroots + 1, 1))) {
+        fclose(f);
+        return fail(s, "pma_load");
+    }
+    if ((len = getline(&line, &n, f)) == -1 ||
+            strncmp(line, SNAP_MAGIC "\n", len)) {
+        goto done;
+    }
+    while ((len = getline(&line, &n, f)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (line[0] == 'R' && line[1] == ' ') {
+            // Each root must lie within some root of the snapshot.
+            rlen = strlen(line + 2);
+            for (r = 0; r < s->nroots; r++) {
+                if (!strncmp(s->roots[r].abs, line + 2, rlen) &&
+                        (s->roots[r].abs[rlen] == '/' ||
+                         s->roots[r].abs[rlen] == '\0')) {
+                    covered[r] = 1;
+                }
+            }
+            continue;
+        }
+        if (!all) {
+            for (r = 0; r < s->nroots && covered[r]; r++);
+            if (r < s->nroots) {
+                goto done;
+            }
+            all = 1;
+        }
+        if (line[0] == 'D' && line[1] == ' ') {
+            struct timespec mtime;
+
+            if (sscanf(line, "D %ld.%ld %n", &ms, &mn, &off) != 2) {
+                continue;
+            }
+            for (r = 0; r < s->nroots; r++) {
+                rlen = strlen(s->roots[r].abs);
+                if (!strncmp(line + off, s->roots[r].abs, rlen) &&
+                        (line[off + rlen] == '/' || line[off + rlen] == '\0')) {
+                    break;
+                }
+            }
+            mtime.tv_sec = ms;
+            mtime.tv_nsec = mn;
+            if (r < s->nroots && !times_match(s, line + off, NULL, &mtime)) {
+                goto done;
+            }
+            continue;
+        }
+        if (sscanf(line, "F %ld.%ld %ld.%ld %lld %n",
+                    &as, &an, &ms, &mn, &size, &off) != 5) {
+            continue;
+        }
+        for (r = 0; r < s->nroots; r++) {
+            const root_t *root = &s->roots[r];
+            char *path;
+
+            rlen = strlen(root->abs);
+            if (strncmp(line + off, root->abs, rlen) ||
+                    line[off + rlen] != '/') {
+                continue;
+            }
+            if (asprintf(&path, "%s%s%s", root->disp,
+                        root->rel > strlen(root->disp) ? "/" : "",
+                        line + off + rlen + 1) == -1) {
+                rc = fail(s, "pma_load");
+                goto done;
+            }
+            if (excluded(s, r, path)) {
+                free(path);
+                break;
+            }
+            if (grow((void **)&s->ents, &s->capents, s->nents + 1,
+                        sizeof(entry_t))) {
+                free(path);
+                rc = fail(s, "pma_load");
+                goto done;
+            }
+            e = &s->ents[s->nents];
+            memset(e, 0, sizeof(*e));
+            e->path = arena_strdup(s, path);
+            free(path);
+            if (!e->path) {
+                rc = fail(s, "pma_load");
+                goto done;
+            }
+            e->root = r;
+            e->rel = root->rel;
+            e->flags = E_BEFORE;
+            e->before[0].tv_sec = as;
+            e->before[0].tv_nsec = an;
+            e->before[1].tv_sec = ms;
+            e->before[1].tv_nsec = mn;
+            e->mark = e->before[1];
+            e->size_before = size;
+            if (!times_match(s, e->path, &e->before[0], &e->before[1])) {
+                goto done;
+            }
+            s->nents++;
+            break;
+        }
+    }
+    if (!all) {
+        for (r = 0; r < s->nroots && covered[r]; r++);
+        all = r == s->nroots;
+    }
+    if (all) {
+        sort_ents(s);
+        s->files_before = s->nents;
+        s->primed = 1;
+        s->fs.now(s->fs.arg, &s->walk_start);
+        s->reftime = s->walk_start;
+        rc = 1;
+    }
+
+done:
+    if (rc != 1) {
+        for (i = 0; i < s->nents; i++) {
+            free(s->ents[i].prehash);
+        }
+        s->nents = 0;
+    }
+    free(covered);
+    free(line);
+    fclose(f);
+    s->ctr.load_ns += now_ns() - start;
+    return rc;
+}
+
+int
+pma_note_read(pma_snapshot_t *s, const char *abspath)
+{
+    if (grow((void **)&s->noted, &s->capnoted, s->nnoted + 1,
+                sizeof(char *)) || !(s->noted[s->nnoted] = strdup(abspath))) {
+        return fail(s, "pma_note_read");
+    }
+    s->nnoted++;
+    s->noted_sorted = 0;
+    return 0;
+}
+
+static int
+is_noted(pma_snapshot_t *s, const entry_t *e)
+{
+    const char *abs;
+
+    if (!s->nnoted) {
+        return 0;
+    }
+    if (!s->noted_sorted) {
+        qsort(s->noted, s->nnoted, sizeof(char *), strvcmp);
+        s->noted_sorted = 1;
+    }
+    return (abs = abspath(s, e)) &&
+        bsearch(&abs, s->noted, s->nnoted, sizeof(char *), strvcmp);
+}
+
+/*
+ * Find a scanned file among the entries or stage a new one for it,
+ * to be merged in by merge_adds() once the walk is done.
+ */
+static entry_t *
+lookup(pma_snapshot_t *s, size_t r, const char *path)
+{
+    entry_t key, *e;
+
+    key.path = path;
+    if ((e = bsearch(&key, s->ents, s->nents, sizeof(entry_t), entcmp))) {
+        return e;
+    }
+    if (grow((void **)&s->adds, &s->capadds, s->nadds + 1, sizeof(entry_t))) {
+        fail(s, "scan");
+        return NULL;
+    }
+    e = &s->adds[s->nadds];
+    memset(e, 0, sizeof(*e));
+    if (!(e->path = arena_strdup(s, path))) {
+        fail(s, "scan");
+        return NULL;
+    }
+    e->root = r;
+    e->rel = s->roots[r].rel;
+    // Created since priming, so new to the audit as a whole.
+    e->before[0].tv_sec = -2L;
+    e->before[1].tv_sec = -1L;
+    e->mark.tv_sec = -1L;
+    s->nadds++;
+    return e;
+}
+
+static int
+merge_adds(pma_snapshot_t *s)
+{
+    entry_t *merged;
+    size_t i = 0, j = 0, k = 0, n;
+
+    s->classified = 0;
+    if (!s->nadds) {
+        return 0;
+    }
+    qsort(s->adds, s->nadds, sizeof(entry_t), entcmp);
+    n = s->nents + s->nadds;
+    if (!(merged = malloc(n * sizeof(entry_t)))) {
+        return fail(s, "scan");
+    }
+    while (i < s->nents || j < s->nadds) {
+        if (j == s->nadds || (i < s->nents &&
+                    strcmp(s->ents[i].path, s->adds[j].path) < 0)) {
+            merged[k++] = s->ents[i++];
+        } else if (k && !strcmp(merged[k - 1].path, s->adds[j].path)) {
+            j++;
+        } else {
+            merged[k++] = s->adds[j++];
+        }
+    }
+    free(s->ents);
+    s->ents = merged;
+    s->nents = k;
+    s->capents = n;
+    s->nadds = 0;
+    return 0;
+}
+
+static int
+checkpoint_visit(pma_snapshot_t *s, size_t r, const char *path,
+        const struct stat *sb, void *arg)
+{
+    void **cb = arg;
+    void (*fn)(void *, const char *) = (void (*)(void *, const char *))cb[0];
+    entry_t *e;
+    int c;
+
+    if (!(e = lookup(s, r, path))) {
+        return -1;
+    }
+    if ((c = tscmp(&sb->st_atim, &sb->st_mtim)) > 0) {
+        e->flags |= E_READ;
+        if (!tscmp(&sb->st_mtim, &e->mark) && fn) {
+            fn(cb[1], e->path);
+        }
+        if (s->flags & PMA_NESTED) {
+            report(s, e);
+        }
+    }
+    e->mark = sb->st_mtim;
+    if (c >= 0) {
+        struct timespec times[2];
+
+        return prime(s, path, sb, times);
+    }
+    return 0;
+}
+
+/*
+ * Rescan at a point within the command: fn is called for each file
+ * read since the last checkpoint (or priming) and not written since.
+ * Those reads count toward the audit as a whole and the files are
+ * primed again so the next interval starts clean.
+ */
+int
+pma_checkpoint(pma_snapshot_t *s, void (*fn)(void *arg, const char *path),
+        void *arg)
+{
+    uint64_t start = now_ns();
+    void *cb[2];
+    int rc;
+
+    if (!s->primed) {
+        return failmsg(s, "pma_checkpoint: not primed");
+    }
+    if (s->budget) {
+        return failmsg(s, "pma_checkpoint: not with a memory budget");
+    }
+    cb[0] = (void *)fn;
+    cb[1] = arg;
+    if (walk(s, checkpoint_visit, cb)) {
+        s->nadds = 0;
+        return -1;
+    }
+    rc = merge_adds(s);
+    s->ctr.checkpoint_ns += now_ns() - start;
+    return rc;
+}
+
+static int
+rescan_visit(pma_snapshot_t *s, size_t r, const char *path,
+        const struct stat *sb, void *arg)
+{
+    unsigned char digest[PMA_DIGEST_MAX];
+    entry_t *e;
+
+    (void)arg;
+    if (!(e = lookup(s, r, path))) {
+        return -1;
+    }
+    e->flags |= E_AFTER;
+    e->after[0] = sb->st_atim;
+    e->after[1] = sb->st_mtim;
+    e->size = sb->st_size;
+    if (e->prehash && tscmp(&e->after[1], &e->before[1]) <= 0) {
+        if (sb->st_size != e->size_before ||
+                s->hooks.hash(s->hooks.arg, path, digest) != e->hashlen ||
+                memcmp(digest, e->prehash, e->hashlen)) {
+            e->flags |= E_CHANGED;
+            s->changed++;
+        }
+    }
+    return 0;
+}
+
+// Under a budget the post-state is spilled like the pre-state.
+static int
+spill_visit(pma_snapshot_t *s, size_t r, const char *path,
+        const struct stat *sb, void *arg)
+{
+    entry_t *e;
+
+    (void)arg;
+    if (over_budget(s) && spill_run(s, &s->post)) {
+        return -1;
+    }
+    if (grow((void **)&s->ents, &s->capents, s->nents + 1, sizeof(entry_t))) {
+        return fail(s, "scan");
+    }
+    e = &s->ents[s->nents];
+    memset(e, 0, sizeof(*e));
+    if (!(e->path = arena_strdup(s, path))) {
+        return fail(s, "scan");
+    }
+    e->root = r;
+    e->rel = s->roots[r].rel;
+    e->flags = E_AFTER;
+    e->after[0] = sb->st_atim;
+    e->after[1] = sb->st_mtim;
+    e->size = sb->st_size;
+    s->nents++;
+    return 0;
+}
+
+static int spill_diff(pma_snapshot_t *s);
+
+int
+pma_rescan(pma_snapshot_t *s)
+{
+    uint64_t start = now_ns();
+    size_t i;
+
+    if (!s->primed) {
+        return failmsg(s, "pma_rescan: not primed");
+    }
+    if (s->budget) {
+        runs_close(&s->post);
+        if (walk(s, spill_visit, NULL) || spill_run(s, &s->post) ||
+                reduce_runs(s, &s->post, spill_fanin(s) / 2) || spill_diff(s)) {
+            return -1;
+        }
+        s->ctr.rescan_ns += now_ns() - start;
+        s->rescanned = 1;
+        return 0;
+    }
+    for (i = 0; i < s->nents; i++) {
+        s->ents[i].flags &= ~(E_AFTER | E_NOTED | E_CHANGED);
+    }
+    if (walk(s, rescan_visit, NULL) || merge_adds(s)) {
+        s->nadds = 0;
+        return -1;
+    }
+    // Reads by nested audits were reported, their atimes reset.
+    for (i = 0; s->nnoted && i < s->nents; i++) {
+        if ((s->ents[i].flags & E_AFTER) && is_noted(s, &s->ents[i])) {
+            s->ents[i].flags |= E_NOTED;
+        }
+    }
+    s->classified = 0;
+    s->ctr.rescan_ns += now_ns() - start;
+    s->rescanned = 1;
+    return 0;
+}
+
+/*
+ * Record a file as though the command had just read it (PMA_PREREQ)
+ * or written it, for when its effects are known some other way.
+ */
+int
+pma_add(pma_snapshot_t *s, const char *path, pma_category_t category)
+{
+    struct stat sb;
+    entry_t *e;
+    size_t r, len;
+
+    if (s->budget) {
+        return failmsg(s, "pma_add: not with a memory budget");
+    }
+    s->ctr.stats++;
+    if (s->fs.stat(s->fs.arg, NULL, path, &sb, 1) == -1) {
+        return fail(s, path);
+    }
+    for (r = 0; r < s->nroots; r++) {
+        len = strlen(s->roots[r].disp);
+        if (!len || (!strncmp(path, s->roots[r].disp, len) &&
+                    path[len] == '/')) {
+            break;
+        }
+    }
+    if (r == s->nroots) {
+        r = 0;
+    }
+    if (!s->nroots) {
+        return failmsg(s, "pma_add: nothing watched");
+    }
+    if (!(e = lookup(s, r, path))) {
+        return -1;
+    }
+    e->flags |= E_AFTER;
+    e->after[0].tv_sec = sb.st_mtime;
+    e->after[0].tv_nsec = 0L;
+    e->after[1] = sb.st_mtim;
+    e->size = sb.st_size;
+    if (category == PMA_PREREQ || category == PMA_UNUSED) {
+        e->flags |= E_BEFORE;
+        e->before[0].tv_sec = sb.st_mtime - (category == PMA_PREREQ);
+        e->before[0].tv_nsec = 0L;
+        e->before[1] = sb.st_mtim;
+    } else {
+        e->before[0].tv_sec = -2L;
+        e->before[0].tv_nsec = 0L;
+        e->before[1].tv_sec = -1L;
+        e->before[1].tv_nsec = 0L;
+        if (category == PMA_INTERMEDIATE) {
+            e->flags |= E_READ;
+        }
+    }
+    s->primed = 1;
+    return merge_adds(s);
+}
+
+static pma_category_t
+classify(const entry_t *e)
+{
+    int read = e->flags & (E_READ | E_NOTED);
+
+    // New files have a negative pre-mtime so they always qualify.
+    if ((e->flags & E_CHANGED) || tscmp(&e->after[1], &e->before[1]) > 0) {
+        return read || tscmp(&e->after[0], &e->after[1]) > 0 ?
+            PMA_INTERMEDIATE : PMA_FINAL;
+    }
+    return read || tscmp(&e->after[0], &e->before[0]) > 0 ?
+        PMA_PREREQ : PMA_UNUSED;
+}
+
+/*
+ * Batch classification. The four timestamps of each entry are packed
+ * as nanoseconds into arrays and compared a vector at a time, giving a
+ * bit per entry for each comparison classify() makes; these combine
+ * with the flags a word at a time into one bitmap per category. Each
+ * kernel sets bit i of bits where a[i] > b[i], for n a multiple of 64.
+ */
+typedef void (*gt_fn)(const int64_t *a, const int64_t *b, size_t n,
+        uint64_t *bits);
+
+static void
+gt_scalar(const int64_t *a, const int64_t *b, size_t n, uint64_t *bits)
+{
+    size_t i, j;
+    uint64_t w;
+
+    for (i = 0; i < n; i += 64) {
+        w = 0;
+        for (j = 0; j < 64; j++) {
+            w |= (uint64_t)(a[i + j] > b[i + j]) << j;
+        }
+        bits[i / 64] = w;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse4.2")))
+static void
+gt_sse42(const int64_t *a, const int64_t *b, size_t n, uint64_t *bits)
+{
+    __m128i x, y;
+    size_t i, j;
+    uint64_t w;
+
+    for (i = 0; i < n; i += 64) {
+        w = 0;
+        for (j = 0; j < 64; j += 2) {
+            x = _mm_loadu_si128((const __m128i *)(a + i + j));
+            y = _mm_loadu_si128((const __m128i *)(b + i + j));
+            w |= (uint64_t)_mm_movemask_pd(
+                    _mm_castsi128_pd(_mm_cmpgt_epi64(x, y))) << j;
+        }
+        bits[i / 64] = w;
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+gt_avx2(const int64_t *a, const int64_t *b, size_t n, uint64_t *bits)
+{
+    __m256i x, y;
+    size_t i, j;
+    uint64_t w;
+
+    for (i = 0; i < n; i += 64) {
+        w = 0;
+        for (j = 0; j < 64; j += 4) {
+            x = _mm256_loadu_si256((const __m256i *)(a + i + j));
+            y = _mm256_loadu_si256((const __m256i *)(b + i + j));
+            w |= (uint64_t)_mm256_movemask_pd(
+                    _mm256_castsi256_pd(_mm256_cmpgt_epi64(x, y))) << j;
+        }
+        bits[i / 64] = w;
+    }
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+static void
+gt_neon(const int64_t *a, const int64_t *b, size_t n, uint64_t *bits)
+{
+    uint64x2_t m;
+    size_t i, j;
+    uint64_t w;
+
+    for (i = 0; i < n; i += 64) {
+        w = 0;
+        for (j = 0; j < 64; j += 2) {
+            m = vcgtq_s64(vld1q_s64(a + i + j), vld1q_s64(b + i + j));
+            w |= ((vgetq_lane_u64(m, 0) & 1) | (vgetq_lane_u64(m, 1) & 2))
+                << j;
+        }
+        bits[i / 64] = w;
+    }
+}
+#endif
+
+typedef struct {
+    const char *name;
+    gt_fn fn;
+} kernel_t;
+
+// In order of preference.
+static const kernel_t kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    {"avx2", gt_avx2},
+    {"sse4.2", gt_sse42},
+#endif
+#ifdef HAVE_NEON_KERNEL
+    {"neon", gt_neon},
+#endif
+    {"scalar", gt_scalar},
+};
+
+static int
+kernel_ok(const kernel_t *k)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (k->fn == gt_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (k->fn == gt_sse42) {
+        return __builtin_cpu_supports("sse4.2");
+    }
+#endif
+    (void)k;
+    return 1;
+}
+
+/*
+ * The best kernel this CPU runs, or the one named by $PMAUDIT_SIMD if
+ * it can run it, chosen on first use.
+ */
+static const kernel_t *
+kernel(void)
+{
+    static const kernel_t *chosen;
+    const char *want;
+    size_t i, n = sizeof(kernels) / sizeof(*kernels);
+
+    if (chosen) {
+        return chosen;
+    }
+    if ((want = getenv("PMAUDIT_SIMD"))) {
+        for (i = 0; i < n; i++) {
+            if (!strcmp(want, kernels[i].name) && kernel_ok(&kernels[i])) {
+                return chosen = &kernels[i];
+            }
+        }
+    }
+    for (i = 0; !kernel_ok(&kernels[i]); i++);
+    return chosen = &kernels[i];
+}
+
+const char *
+pma_classify_kernel(void)
+{
+    return kernel()->name;
+}
+
+int
+pma_api_version(void)
+{
+    return PMA_API_VERSION;
+}
+
+/*
+ * Fill s->cats with a bitmap of the entries in each category plus one
+ * (CAT_ANY) of all present at the rescan, as classify() would have it.
+ */
+static int
+classify_all(pma_snapshot_t *s)
+{
+    int64_t pre_a[CLASSIFY_CHUNK], pre_m[CLASSIFY_CHUNK];
+    int64_t post_a[CLASSIFY_CHUNK], post_m[CLASSIFY_CHUNK];
+    unsigned char fl[CLASSIFY_CHUNK];
+    uint64_t mm[CLASSIFY_CHUNK / 64], am[CLASSIFY_CHUNK / 64];
+    uint64_t aa[CLASSIFY_CHUNK / 64], present, read, forced, target, inter;
+    uint64_t prereq, *cats;
+    gt_fn gt = kernel()->fn;
+    size_t nw = (s->nents + 63) / 64, base, i, n, padded, w, j, k;
+    const entry_t *e;
+
+    if (5 * nw > s->capcats) {
+        if (!(cats = realloc(s->cats, 5 * nw * sizeof(uint64_t)))) {
+            return fail(s, "classify");
+        }
+        s->cats = cats;
+        s->capcats = 5 * nw;
+    }
+    s->catwords = nw;
+    for (base = 0; base < s->nents; base += CLASSIFY_CHUNK) {
+        n = s->nents - base < CLASSIFY_CHUNK ? s->nents - base :
+            CLASSIFY_CHUNK;
+        for (i = 0; i < n; i++) {
+            e = &s->ents[base + i];
+            pre_a[i] = ts_ns(&e->before[0]);
+            pre_m[i] = ts_ns(&e->before[1]);
+            post_a[i] = ts_ns(&e->after[0]);
+            post_m[i] = ts_ns(&e->after[1]);
+            fl[i] = e->flags;
+        }
+        padded = (n + 63) & ~(size_t)63;
+        for (; i < padded; i++) {
+            pre_a[i] = pre_m[i] = post_a[i] = post_m[i] = 0;
+            fl[i] = 0;
+        }
+        gt(post_m, pre_m, padded, mm);      // modified
+        gt(post_a, post_m, padded, am);     // read since modified
+        gt(post_a, pre_a, padded, aa);      // read since primed
+        for (w = 0; w < padded / 64; w++) {
+            present = read = forced = 0;
+            for (j = 0; j < 64; j++) {
+                k = w * 64 + j;
+                present |= (uint64_t)((fl[k] & E_AFTER) != 0) << j;
+                read |= (uint64_t)((fl[k] & (E_READ | E_NOTED)) != 0) << j;
+                forced |= (uint64_t)((fl[k] & E_CHANGED) != 0) << j;
+            }
+            target = mm[w] | forced;
+            inter = target & (read | am[w]);
+            prereq = ~target & (read | aa[w]);
+            k = base / 64 + w;
+            s->cats[PMA_INTERMEDIATE * nw + k] = present & inter;
+            s->cats[PMA_FINAL * nw + k] = present & target & ~inter;
+            s->cats[PMA_PREREQ * nw + k] = present & prereq;
+            s->cats[PMA_UNUSED * nw + k] = present & ~target & ~prereq;
+            s->cats[CAT_ANY * nw + k] = present;
+        }
+    }
+    s->classified = 1;
+    return 0;
+}
+
+/*
+ * Under a budget, join the merged pre-state and post-state by path,
+ * classify each file present at the rescan and write it to the diff.
+ */
+static int
+spill_diff(pma_snapshot_t *s)
+{
+    unsigned char digest[PMA_DIGEST_MAX];
+    merger_t pre, post;
+    reader_t *a, *b;
+    entry_t e;
+    drec_t h;
+    int c = 1, rc = 0;
+
+    if (s->diff) {
+        fclose(s->diff);
+    }
+    s->dpos = 0;
+    s->nafter = 0;
+    s->files_before = 0;
+    if (!(s->diff = spill_open(s))) {
+        return -1;
+    }
+    if (merger_init(s, &pre, s->pre.r, s->pre.n)) {
+        return -1;
+    }
+    if (merger_init(s, &post, s->post.r, s->post.n)) {
+        merger_free(&pre);
+        return -1;
+    }
+    memset(&h, 0, sizeof(h));
+    while (!rc && (b = merger_top(&post))) {
+        while ((a = merger_top(&pre)) && (c = strcmp(a->path, b->path)) < 0) {
+            s->files_before++;
+            if ((rc = merger_pop(s, &pre))) {
+                break;
+            }
+        }
+        if (rc) {
+            break;
+        }
+        memset(&e, 0, sizeof(e));
+        e.path = b->path;
+        e.root = b->h.root;
+        e.rel = s->roots[e.root].rel;
+        e.flags = E_AFTER;
+        e.after[0] = ns_ts(b->h.times[0]);
+        e.after[1] = ns_ts(b->h.times[1]);
+        e.size = b->h.size;
+        if (a && !c) {
+            e.flags |= E_BEFORE;
+            e.before[0] = ns_ts(a->h.times[0]);
+            e.before[1] = ns_ts(a->h.times[1]);
+            if (a->h.hashlen && tscmp(&e.after[1], &e.before[1]) <= 0 &&
+                    (e.size != a->h.size || s->hooks.hash(s->hooks.arg,
+                        e.path, digest) != a->h.hashlen ||
+                     memcmp(digest, a->hash, a->h.hashlen))) {
+                e.flags |= E_CHANGED;
+                s->changed++;
+            }
+        } else {
+            e.before[0].tv_sec = -2L;
+            e.before[1].tv_sec = -1L;
+        }
+        if (is_noted(s, &e)) {
+            e.flags |= E_NOTED;
+        }
+        h.times[0] = ts_ns(&e.before[0]);
+        h.times[1] = ts_ns(&e.before[1]);
+        h.times[2] = b->h.times[0];
+        h.times[3] = b->h.times[1];
+        h.size = e.size;
+        h.pathlen = b->h.pathlen;
+        h.category = classify(&e);
+        h.flags = ((e.flags & E_CHANGED) ? PMA_DIFF_CHANGED : 0) |
+            ((e.flags & E_NOTED) ? PMA_DIFF_NOTED : 0);
+        fwrite(&h, sizeof(h), 1, s->diff);
+        fwrite(b->path, 1, h.pathlen, s->diff);
+        s->nafter++;
+        rc = merger_pop(s, &post);
+    }
+    while (!rc && merger_top(&pre)) {
+        s->files_before++;
+        rc = merger_pop(s, &pre);
+    }
+    merger_free(&pre);
+    merger_free(&post);
+    if (!rc && (fflush(s->diff) == EOF || ferror(s->diff))) {
+        rc = fail(s, "spill");
+    }
+    rewind(s->diff);
+    return rc;
+}
+
+static int
+spill_next(pma_snapshot_t *s, size_t *cursor, pma_diff_t *d, int cat)
+{
+    drec_t h;
+
+    if (!s->diff || (*cursor != s->dpos &&
+                fseeko(s->diff, (off_t)*cursor, SEEK_SET) == -1)) {
+        return 0;
+    }
+    while (fread(&h, sizeof(h), 1, s->diff) == 1) {
+        if (grow((void **)&s->dpath, &s->dpathsz, h.pathlen + 1, 1) ||
+                fread(s->dpath, 1, h.pathlen, s->diff) != h.pathlen) {
+            break;
+        }
+        s->dpath[h.pathlen] = '\0';
+        *cursor = s->dpos = ftello(s->diff);
+        if (cat != CAT_ANY && h.category != cat) {
+            continue;
+        }
+        d->path = s->dpath;
+        d->category = h.category;
+        d->flags = h.flags;
+        d->before[0] = ns_ts(h.times[0]);
+        d->before[1] = ns_ts(h.times[1]);
+        d->after[0] = ns_ts(h.times[2]);
+        d->after[1] = ns_ts(h.times[3]);
+        d->size = h.size;
+        return 1;
+    }
+    *cursor = s->dpos = ftello(s->diff);
+    return 0;
+}
+
+static void
+fill_diff(pma_diff_t *d, const entry_t *e, pma_category_t category)
+{
+    d->path = e->path;
+    d->category = category;
+    d->flags = ((e->flags & E_CHANGED) ? PMA_DIFF_CHANGED : 0) |
+        ((e->flags & E_NOTED) ? PMA_DIFF_NOTED : 0);
+    d->before[0] = e->before[0];
+    d->before[1] = e->before[1];
+    d->after[0] = e->after[0];
+    d->after[1] = e->after[1];
+    d->size = e->size;
+}
+
+/*
+ * The next entry from *cursor on in category cat, or any present at
+ * the rescan for CAT_ANY. Falls back to classifying one at a time if
+ * the bitmaps can't be had.
+ */
+static int
+diff_next(pma_snapshot_t *s, size_t *cursor, pma_diff_t *d, int cat)
+{
+    const uint64_t *bits;
+    const entry_t *e;
+    uint64_t word;
+    size_t i, w;
+    int c;
+
+    if (s->budget) {
+        return spill_next(s, cursor, d, cat);
+    }
+    if (!s->classified && classify_all(s)) {
+        while (*cursor < s->nents) {
+            e = &s->ents[(*cursor)++];
+            if ((e->flags & E_AFTER) &&
+                    ((c = classify(e)) == cat || cat == CAT_ANY)) {
+                fill_diff(d, e, c);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    bits = s->cats + cat * s->catwords;
+    for (i = *cursor; i < s->nents; i = (w + 1) * 64) {
+        w = i / 64;
+        if (!(word = bits[w] & (~0ULL << (i % 64)))) {
+            continue;
+        }
+        i = w * 64 + __builtin_ctzll(word);
+        *cursor = i + 1;
+        if (cat == CAT_ANY) {
+            for (c = PMA_UNUSED; c < PMA_FINAL; c++) {
+                if (s->cats[c * s->catwords + w] >> (i % 64) & 1) {
+                    break;
+                }
+            }
+        } else {
+            c = cat;
+        }
+        fill_diff(d, &s->ents[i], c);
+        return 1;
+    }
+    *cursor = s->nents;
+    return 0;
+}
+
+int
+pma_diff_next(pma_snapshot_t *s, size_t *cursor, pma_diff_t *d)
+{
+    return diff_next(s, cursor, d, CAT_ANY);
+}
+
+void
+pma_get_stats(const pma_snapshot_t *s, pma_stats_t *st)
+{
+    size_t i;
+
+    memset(st, 0, sizeof(*st));
+    st->files_before = s->files_before;
+    for (i = 0; i < s->nents; i++) {
+        st->files_after += (s->ents[i].flags & E_AFTER) != 0;
+    }
+    if (s->budget) {
+        st->files_after = s->nafter;
+    }
+    st->granularity = s->gran;
+    st->ambiguous = s->ambiguous;
+    st->changed = s->changed;
+}
+
+void
+pma_get_counters(const pma_snapshot_t *s, pma_counters_t *c)
+{
+    const arena_t *a;
+    size_t i;
+
+    *c = s->ctr;
+    c->memory = sizeof(*s) + s->capents * sizeof(entry_t) +
+        s->capadds * sizeof(entry_t) + s->capcats * sizeof(uint64_t) +
+        s->abufsz + s->dpathsz +
+        (s->pre.n + s->post.n + (s->diff != NULL)) * SPILL_BUF;
+    for (a = s->arena; a; a = a->next) {
+        c->memory += sizeof(*a) + a->size;
+    }
+    for (i = 0; i < s->nents; i++) {
+        c->memory += s->ents[i].hashlen;
+    }
+    for (i = 0; i < s->nnoted; i++) {
+        c->memory += sizeof(char *) + strlen(s->noted[i]) + 1;
+    }
+}
+
+/*
+ * Write the prereqs in make format as the prereqs of target, each
+ * with an empty rule of its own so make won't balk if one goes away,
+ * or one per line if there's no target. Returns the prereq count.
+ */
+int
+pma_write_deps(pma_snapshot_t *s, FILE *fp, const char *target)
+{
+    size_t cursor = 0;
+    pma_diff_t d;
+    int count = 0;
+
+    while (diff_next(s, &cursor, &d, PMA_PREREQ)) {
+        if (!target) {
+            fprintf(fp, "%s\n", d.path);
+        } else if (count) {
+            fprintf(fp, " \\\n  %s", d.path);
+        } else {
+            fprintf(fp, "%s: \\\n  %s", target, d.path);
+        }
+        count++;
+    }
+    if (target && count) {
+        fputc('\n', fp);
+        for (cursor = 0; diff_next(s, &cursor, &d, PMA_PREREQ); ) {
+            fprintf(fp, "\n%s:\n", d.path);
+        }
+    }
+    if (ferror(fp)) {
+        return fail(s, "pma_write_deps");
+    }
+    return count;
+}
+
+static void
+json_string(FILE *fp, const char *str)
+{
+    const unsigned char *c;
+
+    fputc('"', fp);
+    for (c = (const unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(fp, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(fp, "\\u%04x", *c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static double
+ts_float(const struct timespec *ts)
+{
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+/*
+ * Write the audit as the database pmaudit keeps, so pmaudit can
+ * query it.
+ */
+int
+pma_write_json(pma_snapshot_t *s, FILE *fp, const char *cmd)
+{
+    static const char *sections[] = {
+        "UNUSED", "PREREQS", "INTERMEDIATES", "FINALS"
+    };
+    static const pma_category_t order[] = {
+        PMA_PREREQ, PMA_INTERMEDIATE, PMA_FINAL, PMA_UNUSED
+    };
+    char host[256], cwd[PATH_MAX], when[64], base[PATH_MAX + 260];
+    struct tm tm;
+    size_t cursor, i, after = 0;
+    pma_diff_t d;
+    int first;
+
+    if (gethostname(host, sizeof(host)) == -1 || !getcwd(cwd, sizeof(cwd))) {
+        return fail(s, "pma_write_json");
+    }
+    host[sizeof(host) - 1] = '\0';
+    snprintf(base, sizeof(base), "%s:%s", host, cwd);
+    gmtime_r(&s->reftime.tv_sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    for (cursor = 0; pma_diff_next(s, &cursor, &d); after++);
+
+    fputs("{\n  \"BASE\": ", fp);
+    json_string(fp, base);
+    fputs(",\n  \"CMD\": ", fp);
+    json_string(fp, cmd ? cmd : "None");
+    fprintf(fp, ",\n  \"START\": \"%s.%06ldZ (%f)\",\n", when,
+            s->reftime.tv_nsec / 1000, ts_float(&s->reftime));
+    fprintf(fp, "  \"PRIOR_COUNT\": \"%zu\",\n", s->files_before);
+    fprintf(fp, "  \"AFTER_COUNT\": \"%zu\",\n", after);
+    fputs("  \"DB\": {", fp);
+    for (i = 0; i < 4; i++) {
+        fprintf(fp, "%s\n    \"%s\": {", i ? "," : "", sections[order[i]]);
+        first = 1;
+        for (cursor = 0; diff_next(s, &cursor, &d, order[i]); ) {
+            fputs(first ? "\n      " : ",\n      ", fp);
+            json_string(fp, d.path);
+            if (d.before[1].tv_sec < 0) {
+                fprintf(fp, ": \"-2,-1,%.07f,%.07f\"",
+                        ts_float(&d.after[0]), ts_float(&d.after[1]));
+            } else if (d.category == PMA_UNUSED) {
+                fprintf(fp, ": \"%.07f,%.07f,0,0\"",
+                        ts_float(&d.before[0]), ts_float(&d.before[1]));
+            } else {
+                fprintf(fp, ": \"%.07f,%.07f,%.07f,%.07f\"",
+                        ts_float(&d.before[0]), ts_float(&d.before[1]),
+                        ts_float(&d.after[0]), ts_float(&d.after[1]));
+            }
+            first = 0;
+        }
+        fputs(first ? "}" : "\n    }", fp);
+    }
+    fputs("\n  }\n}\n", fp);
+    if (ferror(fp)) {
+        return fail(s, "pma_write_json");
+    }
+    return 0;
+}
+
+/*
+ * As a nested audit, report and re-prime whatever the command read so
+ * the enclosing audit sees it. The post-state is updated to match.
+ */
+int
+pma_reprime(pma_snapshot_t *s)
+{
+    struct stat sb;
+    size_t i;
+    entry_t *e;
+    int c;
+
+    if (s->budget) {
+        return failmsg(s, "pma_reprime: not with a memory budget");
+    }
+    s->classified = 0;
+    for (i = 0; i < s->nents; i++) {
+        e = &s->ents[i];
+        if (!(e->flags & E_AFTER) || (s->ctr.stats++,
+                    s->fs.stat(s->fs.arg, NULL, e->path, &sb, 1) == -1)) {
+            continue;
+        }
+        e->after[0] = sb.st_atim;
+        e->after[1] = sb.st_mtim;
+        e->size = sb.st_size;
+        if ((c = tscmp(&sb.st_atim, &sb.st_mtim)) >= 0) {
+            if (c > 0) {
+                report(s, e);
+            }
+            if (prime(s, e->path, &sb, e->after)) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Record the mtime of each directory from root r down to the one
+ * holding the file at abs, other than those above the file saved
+ * before it, in prev. pma_load() checks them to tell whether files
+ * were created, removed or renamed since; directories with no files
+ * beneath them go unchecked. A directory modified so recently that
+ * another change might not move its mtime gets an impossible one.
+ */
+static int
+save_dirs(pma_snapshot_t *s, FILE *f, size_t r, const char *abs,
+        char **prev, size_t *prevsz, const struct timespec *now)
+{
+    size_t k, j, rlen = strlen(s->roots[r].abs), len = strlen(abs);
+    struct stat sb;
+    char *dir;
+
+    for (k = 0; *prev && (*prev)[k] && (*prev)[k] == abs[k]; k++);
+    if (grow((void **)prev, prevsz, len + 1, 1) == -1) {
+        return fail(s, "pma_save");
+    }
+    dir = memcpy(*prev, abs, len + 1);
+    for (j = rlen; j < len; j++) {
+        if (dir[j] != '/' || j < k) {
+            continue;
+        }
+        dir[j] = '\0';
+        s->ctr.stats++;
+        if (s->fs.stat(s->fs.arg, NULL, dir, &sb, 1) != -1) {
+            if (is_racy(s, &sb.st_mtim, now)) {
+                sb.st_mtim.tv_sec = -1;
+                sb.st_mtim.tv_nsec = 0;
+            }
+            fprintf(f, "D %ld.%09ld %s\n", (long)sb.st_mtim.tv_sec,
+                    sb.st_mtim.tv_nsec, dir);
+        }
+        dir[j] = '/';
+    }
+    return 0;
+}
+
+// Leave the post-state where the next nested audit can start from it.
+int
+pma_save(pma_snapshot_t *s, const char *file)
+{
+    char *tmpf, *prev = NULL;
+    const char *abs;
+    size_t i, prevsz = 0;
+    struct timespec now;
+    FILE *f;
+    int rc = 0;
+
+    if (s->budget) {
+        return failmsg(s, "pma_save: not with a memory budget");
+    }
+    s->fs.now(s->fs.arg, &now);
+    if (asprintf(&tmpf, "%s.%ld.tmp", file, (long)getpid()) == -1) {
+        return fail(s, "pma_save");
+    }
+    s->ctr.opens++;
+    if (!(f = fopen(tmpf, "w"))) {
+        fail(s, tmpf);
+        free(tmpf);
+        return -1;
+    }
+    fprintf(f, "%s\n", SNAP_MAGIC);
+    for (i = 0; i < s->nroots; i++) {
+        fprintf(f, "R %s\n", s->roots[i].abs);
+    }
+    // Until a rescan, the state to hand on is the primed one.
+    for (i = 0; i < s->nents; i++) {
+        const entry_t *e = &s->ents[i];
+        const struct timespec *t = s->rescanned ? e->after : e->before;
+
+        if (!(e->flags & (s->rescanned ? E_AFTER : E_BEFORE)) ||
+                !(abs = abspath(s, e))) {
+            continue;
+        }
+        fprintf(f, "F %ld.%09ld %ld.%09ld %lld %s\n",
+                (long)t[0].tv_sec, t[0].tv_nsec,
+                (long)t[1].tv_sec, t[1].tv_nsec,
+                (long long)(s->rescanned ? e->size : e->size_before), abs);
+        if ((rc = save_dirs(s, f, e->root, abs, &prev, &prevsz, &now))) {
+            break;
+        }
+    }
+    free(prev);
+    if (fclose(f) == EOF || rc || rename(tmpf, file) == -1) {
+        if (!rc) {
+            fail(s, file);
+        }
+        unlink(tmpf);
+        free(tmpf);
+        return -1;
+    }
+    free(tmpf);
+    return 0;
+}
+
+// vim: ts=8:sw=4:tw=80:et:
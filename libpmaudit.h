@@ -0,0 +1,272 @@
+/******************************************************************************
+ * Copyright (C) 2010-2018 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * libpmaudit: the atime/mtime audit engine behind pmash, usable in-process.
+ *
+ * A snapshot records the state of one or more watched directory trees:
+ *
+ *     pma_snapshot_t *s = pma_snapshot_new();
+ *     pma_watch(s, "src");
+ *     pma_prime(s);               // record and prime the pre-state
+ *     ... run the command ...
+ *     pma_rescan(s);              // record the post-state
+ *     pma_write_deps(s, fp, "foo.o");
+ *     pma_snapshot_free(s);
+ *
+ * Functions returning int give -1 on failure with the reason available
+ * from pma_error(). No state is shared between snapshots, so separate
+ * audits may proceed in one process, though not over the same files
+ * at the same time.
+ *
+ * The watched trees are reached through a table of filesystem
+ * operations, by default the POSIX calls. pma_memfs provides another
+ * which simulates a filesystem in memory, with a choice of atime
+ * semantics and timestamp granularity, for benchmarks and tests.
+ * pma_hasher hashes file content for the front ends, with a cache.
+ */
+
+#ifndef LIBPMAUDIT_H
+#define LIBPMAUDIT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped when the API changes incompatibly. Tables of functions passed
+// in begin with their size so that members can be added compatibly.
+#define PMA_API_VERSION 1
+
+#define PMA_DIGEST_MAX 32
+
+typedef struct pma_snapshot pma_snapshot_t;
+
+typedef enum {
+    PMA_UNUSED,             // existed before, neither read nor written
+    PMA_PREREQ,             // existed before, read but not written
+    PMA_INTERMEDIATE,       // written, then read
+    PMA_FINAL               // written and not read since
+} pma_category_t;
+
+// Flags describing how a diff entry was classified.
+#define PMA_DIFF_CHANGED    0x1 // content differs despite an unmoved mtime
+#define PMA_DIFF_NOTED      0x2 // read reported through pma_note_read()
+
+typedef struct {
+    const char *path;
+    pma_category_t category;
+    unsigned flags;
+    struct timespec before[2];  // atime, mtime as primed; tv_sec < 0 if new
+    struct timespec after[2];   // atime, mtime at rescan
+    off_t size;
+} pma_diff_t;
+
+typedef struct {
+    size_t size;                // sizeof(pma_hooks_t)
+    void *arg;
+    // Hash a file's content into digest, returning its length or -1.
+    // Used to tell if a file changed within one timestamp granule.
+    int (*hash)(void *arg, const char *path, unsigned char *digest);
+    // A file (absolute path) was read and is about to be re-primed.
+    void (*report)(void *arg, const char *abspath);
+    // The times of path were just reset; sb is its state before.
+    void (*retimed)(void *arg, const char *path, const struct stat *sb);
+} pma_hooks_t;
+
+typedef struct {
+    size_t files_before;
+    size_t files_after;
+    long granularity;           // apparent timestamp granularity, ns
+    unsigned ambiguous;         // files hashed due to coarse timestamps
+    unsigned changed;           // of those, files found modified
+} pma_stats_t;
+
+// Work done so far, for instrumentation. Times are monotonic.
+typedef struct {
+    uint64_t probe_ns;          // checking that atimes are updated
+    uint64_t prime_ns;          // walking and priming the pre-state
+    uint64_t load_ns;           // taking the pre-state from a file
+    uint64_t checkpoint_ns;     // all checkpoints together
+    uint64_t rescan_ns;         // walking the post-state
+    uint64_t files, dirs;       // visited by walks
+    uint64_t stats, utimes, opens;  // system calls made
+    size_t memory;              // bytes held by the snapshot
+} pma_counters_t;
+
+/*
+ * Filesystem operations. Those returning int give -1 with errno set on
+ * failure. A directory handle from opendir() may be passed to stat()
+ * to look up a name within it; otherwise name is a path. Paths are
+ * relative to the current directory as with the POSIX calls.
+ */
+typedef struct {
+    size_t size;                // sizeof(pma_fsops_t)
+    void *arg;
+    void *(*opendir)(void *arg, const char *path);
+    // The next name in dir other than "." and "..", or NULL at the end,
+    // with its inode number in *ino.
+    const char *(*readdir)(void *arg, void *dir, ino_t *ino);
+    void (*closedir)(void *arg, void *dir);
+    // stat(2), or lstat(2) unless follow is set.
+    int (*stat)(void *arg, void *dir, const char *name, struct stat *sb,
+            int follow);
+    // utimensat(2), honoring UTIME_NOW and UTIME_OMIT.
+    int (*set_times)(void *arg, const char *path,
+            const struct timespec times[2]);
+    // Create a small file that mustn't exist, read one, remove one:
+    // used to find out how atimes are updated.
+    int (*create)(void *arg, const char *path);
+    int (*read)(void *arg, const char *path);
+    int (*unlink)(void *arg, const char *path);
+    // realpath(3), returning a string to be freed.
+    char *(*realpath)(void *arg, const char *path);
+    // The clock file timestamps are taken from.
+    void (*now)(void *arg, struct timespec *ts);
+} pma_fsops_t;
+
+// Snapshot flags.
+#define PMA_NESTED      0x1 // inside another audit: leave unread files be
+#define PMA_NOPROBE     0x2 // skip checking that atimes are updated
+#define PMA_COLDCACHE   0x4 // read each directory whole, stat in inode order
+
+pma_snapshot_t *pma_snapshot_new(void);
+void pma_snapshot_free(pma_snapshot_t *s);
+const char *pma_error(const pma_snapshot_t *s);
+
+void pma_set_flags(pma_snapshot_t *s, unsigned flags);
+// Refused if hooks->size isn't that of the pma_hooks_t built here.
+int pma_set_hooks(pma_snapshot_t *s, const pma_hooks_t *hooks);
+void pma_set_granularity(pma_snapshot_t *s, long ns);
+/*
+ * Keep the snapshot within about this many bytes, whatever the size of
+ * the tree, by spilling sorted runs of entries to files in $TMPDIR and
+ * diffing by an external merge; 0, the default, is no limit and less
+ * than 1MB is taken as 1MB. Must precede pma_prime(). A budgeted
+ * snapshot can't be loaded, saved, checkpointed, added to or reprimed,
+ * and the path of a diff is only good until the next pma_diff_next().
+ */
+int pma_set_budget(pma_snapshot_t *s, size_t bytes);
+// Must precede pma_watch(); NULL restores the POSIX calls. Refused,
+// like pma_set_hooks(), if ops->size is another size.
+int pma_set_fsops(pma_snapshot_t *s, const pma_fsops_t *ops);
+// Skip files and directories, without entering them, whose names match
+// pattern as with fnmatch(3): ".git" matches only that name, "*.swp"
+// any name ending so. Nothing is excluded unless asked for.
+int pma_exclude(pma_snapshot_t *s, const char *pattern);
+// Skip the one file or directory at path, which needn't exist yet.
+int pma_exclude_path(pma_snapshot_t *s, const char *path);
+int pma_watch(pma_snapshot_t *s, const char *dir);
+
+int pma_prime(pma_snapshot_t *s);
+int pma_load(pma_snapshot_t *s, const char *file);
+int pma_note_read(pma_snapshot_t *s, const char *abspath);
+int pma_checkpoint(pma_snapshot_t *s,
+        void (*fn)(void *arg, const char *path), void *arg);
+int pma_rescan(pma_snapshot_t *s);
+int pma_add(pma_snapshot_t *s, const char *path, pma_category_t category);
+
+int pma_diff_next(pma_snapshot_t *s, size_t *cursor, pma_diff_t *d);
+void pma_get_stats(const pma_snapshot_t *s, pma_stats_t *st);
+void pma_get_counters(const pma_snapshot_t *s, pma_counters_t *c);
+// Which vector kernel classifies ("avx2", "sse4.2", "neon", "scalar").
+const char *pma_classify_kernel(void);
+// PMA_API_VERSION as built, for callers that load the library at runtime.
+int pma_api_version(void);
+
+int pma_write_deps(pma_snapshot_t *s, FILE *fp, const char *target);
+int pma_write_json(pma_snapshot_t *s, FILE *fp, const char *cmd);
+int pma_reprime(pma_snapshot_t *s);
+// Saved before pma_rescan(), the snapshot holds the primed pre-state.
+int pma_save(pma_snapshot_t *s, const char *file);
+
+/*
+ * An in-memory filesystem. Its clock starts at a fixed time and moves
+ * a nanosecond with each change, or as told, so runs are repeatable.
+ * Timestamps are truncated to the given granularity, and reads update
+ * atimes as the mount option named by the atime mode would have them.
+ * Paths are relative to its root, which stands in for the current
+ * directory; parent directories are created as needed.
+ */
+typedef enum {
+    PMA_RELATIME,           // only if not later than mtime/ctime, or a day old
+    PMA_STRICTATIME,        // on every read
+    PMA_NOATIME             // never
+} pma_atime_t;
+
+typedef struct pma_memfs pma_memfs_t;
+
+pma_memfs_t *pma_memfs_new(pma_atime_t mode, long granularity);
+void pma_memfs_free(pma_memfs_t *m);
+void pma_memfs_fsops(pma_memfs_t *m, pma_fsops_t *ops);
+int pma_memfs_write(pma_memfs_t *m, const char *path, off_t size);
+int pma_memfs_read(pma_memfs_t *m, const char *path);
+int pma_memfs_remove(pma_memfs_t *m, const char *path);
+void pma_memfs_advance(pma_memfs_t *m, long ns);
+// A pma_hooks_t hash, with the memfs as arg, naming each file version.
+int pma_memfs_hash(void *m, const char *path, unsigned char *digest);
+
+/*
+ * Content hashing, for restat, caches and memos, and as the hash hook
+ * of a snapshot. Large files are hashed in chunks on several threads,
+ * and a hasher given a cache file keeps each file's digest with its
+ * size, mtime and ctime there so unchanged files needn't be read again.
+ * Functions returning int give -1 with errno set on failure.
+ */
+typedef struct {
+    unsigned len;
+    unsigned char b[PMA_DIGEST_MAX];
+} pma_digest_t;
+
+typedef struct {
+    uint64_t files, bytes;      // hashed by reading them
+    uint64_t hits;              // found in the cache instead
+    uint64_t nsecs;             // spent reading and hashing
+} pma_hash_counters_t;
+
+typedef struct pma_hasher pma_hasher_t;
+
+// algo is "vh128", a fast non-cryptographic hash, or "sha256".
+pma_hasher_t *pma_hasher_new(const char *algo);
+void pma_hasher_free(pma_hasher_t *h);
+const char *pma_hasher_algo(const pma_hasher_t *h);
+unsigned pma_hasher_len(const pma_hasher_t *h);
+// Threads to hash a large file with: 1 by default, at most 8.
+void pma_hasher_set_threads(pma_hasher_t *h, unsigned n);
+// Files modified within this many ns of being hashed aren't cached.
+void pma_hasher_set_granularity(pma_hasher_t *h, long ns);
+// Load the cache from file, if it exists, and save back to it.
+int pma_hasher_cache(pma_hasher_t *h, const char *file);
+int pma_hasher_save(pma_hasher_t *h);
+void pma_hash_buf(const pma_hasher_t *h, const void *buf, size_t len,
+        pma_digest_t *d);
+int pma_hash_file(pma_hasher_t *h, const char *path, pma_digest_t *d);
+void pma_hasher_get_counters(const pma_hasher_t *h, pma_hash_counters_t *c);
+// pma_hooks_t hash and retimed with the hasher as arg. The hash reads
+// the file regardless of the cache, which keeps a retimed file's entry.
+int pma_hasher_hook(void *h, const char *path, unsigned char *digest);
+void pma_hasher_retimed(void *h, const char *path, const struct stat *before);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBPMAUDIT_H */
@@ -0,0 +1,627 @@
+/******************************************************************************
+ * Copyright (C) 2010-2018 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * pma_memfs: a filesystem held in memory and reached through the
+ * pma_fsops_t table, so that the audit engine can be run over millions
+ * of files, under any atime semantics and timestamp granularity,
+ * without a disk or particular mount options.
+ *
+ * Nodes are found by path in an open-addressed hash table; each
+ * directory also lists its children in order of creation, which is
+ * the order readdir returns them in.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libpmaudit.h"
+
+#define MEMFS_ROOT "/memfs"         // what realpath makes of the root
+#define MEMFS_EPOCH 1500000000L     // where the clock starts, in seconds
+#define MEMFS_EPOCH_NS 123456789L   // not round, as a real clock wouldn't be
+#define MEMFS_DAY (24L * 60 * 60)
+#define NS 1000000000LL
+
+typedef struct node {
+    char *path;                 // from the root, "" for the root itself
+    const char *name;           // last component of path
+    struct node *parent;
+    struct node **kids;
+    size_t nkids, capkids;
+    struct timespec atime, mtime, ctime;
+    off_t size;
+    uint64_t version;           // bumped by each write
+    ino_t ino;
+    int isdir;
+} node_t;
+
+typedef struct {
+    node_t *dir;
+    size_t next;
+} memdir_t;
+
+struct pma_memfs {
+    pma_atime_t mode;
+    long gran;
+    struct timespec clock;
+    node_t **table;
+    size_t tabsize, used;       // used counts removed slots as well
+    node_t *root;
+    ino_t lastino;
+    char *buf, *jbuf;           // scratch for normalized and joined paths
+    size_t bufsz, jbufsz;
+};
+
+// Marks the table slot of a removed node, so probing continues past it.
+static node_t removed;
+
+static uint64_t
+hash_str(const char *str)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*str) {
+        h = (h ^ (unsigned char)*str++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int
+room(char **buf, size_t *sz, size_t need)
+{
+    char *p;
+
+    if (need <= *sz) {
+        return 0;
+    }
+    if (!(p = realloc(*buf, need * 2))) {
+        return -1;
+    }
+    *buf = p;
+    *sz = need * 2;
+    return 0;
+}
+
+/*
+ * Reduce a path to the form nodes are keyed by: no leading "./" or
+ * MEMFS_ROOT, no doubled or trailing slashes, and "" for the root.
+ */
+static const char *
+normalize(pma_memfs_t *m, const char *path)
+{
+    size_t rlen = strlen(MEMFS_ROOT);
+    char *out;
+
+    if (!strncmp(path, MEMFS_ROOT, rlen) &&
+            (path[rlen] == '/' || path[rlen] == '\0')) {
+        path += rlen;
+    }
+    if (room(&m->buf, &m->bufsz, strlen(path) + 1) == -1) {
+        return NULL;
+    }
+    out = m->buf;
+    while (*path) {
+        while (*path == '/') {
+            path++;
+        }
+        if (path[0] == '.' && (path[1] == '/' || path[1] == '\0')) {
+            path++;
+            continue;
+        }
+        if (!*path) {
+            break;
+        }
+        if (out > m->buf) {
+            *out++ = '/';
+        }
+        while (*path && *path != '/') {
+            *out++ = *path++;
+        }
+    }
+    *out = '\0';
+    return m->buf;
+}
+
+static node_t **
+slot(pma_memfs_t *m, const char *key)
+{
+    size_t i, mask = m->tabsize - 1;
+    node_t **free_slot = NULL;
+
+    for (i = hash_str(key) & mask; m->table[i]; i = (i + 1) & mask) {
+        if (m->table[i] == &removed) {
+            if (!free_slot) {
+                free_slot = &m->table[i];
+            }
+        } else if (!strcmp(m->table[i]->path, key)) {
+            return &m->table[i];
+        }
+    }
+    return free_slot ? free_slot : &m->table[i];
+}
+
+static node_t *
+lookup(pma_memfs_t *m, const char *path)
+{
+    const char *key;
+    node_t *n;
+
+    if (!(key = normalize(m, path))) {
+        return NULL;
+    }
+    n = *slot(m, key);
+    if (!n || n == &removed) {
+        errno = ENOENT;
+        return NULL;
+    }
+    return n;
+}
+
+static int
+rehash(pma_memfs_t *m)
+{
+    node_t **old = m->table;
+    size_t i, oldsize = m->tabsize;
+
+    m->tabsize = oldsize ? oldsize * 2 : 1024;
+    if (!(m->table = calloc(m->tabsize, sizeof(node_t *)))) {
+        m->table = old;
+        m->tabsize = oldsize;
+        return -1;
+    }
+    m->used = 0;
+    for (i = 0; i < oldsize; i++) {
+        if (old[i] && old[i] != &removed) {
+            *slot(m, old[i]->path) = old[i];
+            m->used++;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static void
+tick(pma_memfs_t *m)
+{
+    pma_memfs_advance(m, 1);
+}
+
+// The clock as a timestamp of the filesystem's granularity.
+static void
+stamp(const pma_memfs_t *m, const struct timespec *in, struct timespec *out)
+{
+    long long t = in->tv_sec * NS + in->tv_nsec;
+
+    t -= t % m->gran;
+    out->tv_sec = t / NS;
+    out->tv_nsec = t % NS;
+}
+
+static int
+tscmp(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec) {
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    }
+    return a->tv_nsec < b->tv_nsec ? -1 : a->tv_nsec > b->tv_nsec;
+}
+
+// Add a node for a normalized path whose parent exists.
+static node_t *
+add_node(pma_memfs_t *m, node_t *parent, const char *key, int isdir)
+{
+    node_t *n, **kids;
+    const char *slash;
+
+    if ((m->used + 1) * 2 > m->tabsize && rehash(m) == -1) {
+        return NULL;
+    }
+    if (!(n = calloc(1, sizeof(*n))) || !(n->path = strdup(key))) {
+        free(n);
+        return NULL;
+    }
+    if (parent) {
+        if (parent->nkids == parent->capkids) {
+            if (!(kids = realloc(parent->kids, (parent->capkids ?
+                                parent->capkids * 2 : 8) * sizeof(node_t *)))) {
+                free(n->path);
+                free(n);
+                return NULL;
+            }
+            parent->kids = kids;
+            parent->capkids = parent->capkids ? parent->capkids * 2 : 8;
+        }
+        parent->kids[parent->nkids++] = n;
+        stamp(m, &m->clock, &parent->mtime);
+        parent->ctime = parent->mtime;
+    }
+    slash = strrchr(n->path, '/');
+    n->name = slash ? slash + 1 : n->path;
+    n->parent = parent;
+    n->isdir = isdir;
+    n->ino = ++m->lastino;
+    stamp(m, &m->clock, &n->mtime);
+    n->atime = n->ctime = n->mtime;
+    *slot(m, n->path) = n;
+    m->used++;
+    return n;
+}
+
+// Find the directory path would be created in, making it if need be.
+static node_t *
+make_parents(pma_memfs_t *m, const char *key)
+{
+    char *path, *slash;
+    node_t *dir = m->root, *n;
+
+    if (!(path = strdup(key))) {
+        return NULL;
+    }
+    for (slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        n = *slot(m, path);
+        if (!n || n == &removed) {
+            n = add_node(m, dir, path, 1);
+        } else if (!n->isdir) {
+            errno = ENOTDIR;
+            n = NULL;
+        }
+        *slash = '/';
+        if (!(dir = n)) {
+            break;
+        }
+    }
+    free(path);
+    return dir;
+}
+
+pma_memfs_t *
+pma_memfs_new(pma_atime_t mode, long granularity)
+{
+    pma_memfs_t *m;
+
+    if (!(m = calloc(1, sizeof(*m)))) {
+        return NULL;
+    }
+    m->mode = mode;
+    m->gran = granularity > 0 ? granularity : 1;
+    m->clock.tv_sec = MEMFS_EPOCH;
+    m->clock.tv_nsec = MEMFS_EPOCH_NS;
+    if (rehash(m) == -1 || !(m->root = add_node(m, NULL, "", 1))) {
+        pma_memfs_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void
+pma_memfs_free(pma_memfs_t *m)
+{
+    size_t i;
+
+    if (!m) {
+        return;
+    }
+    for (i = 0; i < m->tabsize; i++) {
+        if (m->table[i] && m->table[i] != &removed) {
+            free(m->table[i]->kids);
+            free(m->table[i]->path);
+            free(m->table[i]);
+        }
+    }
+    free(m->table);
+    free(m->buf);
+    free(m->jbuf);
+    free(m);
+}
+
+void
+pma_memfs_advance(pma_memfs_t *m, long ns)
+{
+    long long t = m->clock.tv_sec * NS + m->clock.tv_nsec + ns;
+
+    m->clock.tv_sec = t / NS;
+    m->clock.tv_nsec = t % NS;
+}
+
+int
+pma_memfs_write(pma_memfs_t *m, const char *path, off_t size)
+{
+    const char *key;
+    node_t *n, *dir;
+    char *copy;
+
+    tick(m);
+    if (!(key = normalize(m, path))) {
+        return -1;
+    }
+    if (!(n = *slot(m, key)) || n == &removed) {
+        // make_parents() reuses the scratch buffer key is in.
+        if (!(copy = strdup(key))) {
+            return -1;
+        }
+        n = (dir = make_parents(m, copy)) ? add_node(m, dir, copy, 0) : NULL;
+        free(copy);
+        if (!n) {
+            return -1;
+        }
+    } else if (n->isdir) {
+        errno = EISDIR;
+        return -1;
+    }
+    n->size = size;
+    n->version++;
+    stamp(m, &m->clock, &n->mtime);
+    n->ctime = n->mtime;
+    return 0;
+}
+
+int
+pma_memfs_read(pma_memfs_t *m, const char *path)
+{
+    struct timespec now;
+    node_t *n;
+
+    tick(m);
+    if (!(n = lookup(m, path))) {
+        return -1;
+    }
+    if (n->isdir) {
+        errno = EISDIR;
+        return -1;
+    }
+    stamp(m, &m->clock, &now);
+    switch (m->mode) {
+        case PMA_RELATIME:
+            if (tscmp(&n->atime, &n->mtime) > 0 &&
+                    tscmp(&n->atime, &n->ctime) > 0 &&
+                    now.tv_sec - n->atime.tv_sec < MEMFS_DAY) {
+                break;
+            }
+            // FALLTHROUGH
+        case PMA_STRICTATIME:
+            n->atime = now;
+            break;
+        case PMA_NOATIME:
+            break;
+    }
+    return 0;
+}
+
+int
+pma_memfs_remove(pma_memfs_t *m, const char *path)
+{
+    node_t *n, *p;
+    size_t i;
+
+    tick(m);
+    if (!(n = lookup(m, path))) {
+        return -1;
+    }
+    if (!(p = n->parent) || n->nkids) {
+        errno = p ? ENOTEMPTY : EBUSY;
+        return -1;
+    }
+    for (i = 0; p->kids[i] != n; i++);
+    memmove(&p->kids[i], &p->kids[i + 1], (--p->nkids - i) * sizeof(node_t *));
+    stamp(m, &m->clock, &p->mtime);
+    p->ctime = p->mtime;
+    *slot(m, n->path) = &removed;
+    free(n->kids);
+    free(n->path);
+    free(n);
+    return 0;
+}
+
+int
+pma_memfs_hash(void *arg, const char *path, unsigned char *digest)
+{
+    node_t *n;
+
+    if (!(n = lookup(arg, path))) {
+        return -1;
+    }
+    memcpy(digest, &n->ino, sizeof(n->ino));
+    memcpy(digest + sizeof(n->ino), &n->version, sizeof(n->version));
+    return sizeof(n->ino) + sizeof(n->version);
+}
+
+/*
+ * The pma_fsops_t functions.
+ */
+static void *
+memfs_opendir(void *arg, const char *path)
+{
+    memdir_t *d;
+    node_t *n;
+
+    if (!(n = lookup(arg, path))) {
+        return NULL;
+    }
+    if (!n->isdir) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    if ((d = malloc(sizeof(*d)))) {
+        d->dir = n;
+        d->next = 0;
+    }
+    return d;
+}
+
+static const char *
+memfs_readdir(void *arg, void *dir, ino_t *ino)
+{
+    memdir_t *d = dir;
+    node_t *n;
+
+    (void)arg;
+    if (d->next == d->dir->nkids) {
+        return NULL;
+    }
+    n = d->dir->kids[d->next++];
+    *ino = n->ino;
+    return n->name;
+}
+
+static void
+memfs_closedir(void *arg, void *dir)
+{
+    (void)arg;
+    free(dir);
+}
+
+static int
+memfs_stat(void *arg, void *dir, const char *name, struct stat *sb, int follow)
+{
+    pma_memfs_t *m = arg;
+    const char *dpath;
+    node_t *n;
+    size_t dlen;
+
+    (void)follow;
+    if (dir) {
+        dpath = ((memdir_t *)dir)->dir->path;
+        dlen = strlen(dpath);
+        if (room(&m->jbuf, &m->jbufsz, dlen + strlen(name) + 2) == -1) {
+            return -1;
+        }
+        memcpy(m->jbuf, dpath, dlen);
+        m->jbuf[dlen] = '/';
+        strcpy(m->jbuf + dlen + !!dlen, name);
+        name = m->jbuf;
+    }
+    if (!(n = lookup(m, name))) {
+        return -1;
+    }
+    memset(sb, 0, sizeof(*sb));
+    sb->st_dev = 1;
+    sb->st_ino = n->ino;
+    sb->st_mode = n->isdir ? S_IFDIR | 0755 : S_IFREG | 0644;
+    sb->st_nlink = 1;
+    sb->st_size = n->size;
+    sb->st_blksize = 4096;
+    sb->st_blocks = (n->size + 511) / 512;
+    sb->st_atim = n->atime;
+    sb->st_mtim = n->mtime;
+    sb->st_ctim = n->ctime;
+    return 0;
+}
+
+static int
+memfs_set_times(void *arg, const char *path, const struct timespec times[2])
+{
+    pma_memfs_t *m = arg;
+    struct timespec *dst[2];
+    node_t *n;
+    int i;
+
+    tick(m);
+    if (!(n = lookup(m, path))) {
+        return -1;
+    }
+    dst[0] = &n->atime;
+    dst[1] = &n->mtime;
+    for (i = 0; i < 2; i++) {
+        if (times[i].tv_nsec == UTIME_NOW) {
+            stamp(m, &m->clock, dst[i]);
+        } else if (times[i].tv_nsec != UTIME_OMIT) {
+            stamp(m, &times[i], dst[i]);
+        }
+    }
+    stamp(m, &m->clock, &n->ctime);
+    return 0;
+}
+
+static int
+memfs_create(void *arg, const char *path)
+{
+    if (lookup(arg, path)) {
+        errno = EEXIST;
+        return -1;
+    }
+    return pma_memfs_write(arg, path, 5);
+}
+
+static int
+memfs_read(void *arg, const char *path)
+{
+    return pma_memfs_read(arg, path);
+}
+
+static int
+memfs_unlink(void *arg, const char *path)
+{
+    node_t *n;
+
+    if (!(n = lookup(arg, path))) {
+        return -1;
+    }
+    if (n->isdir) {
+        errno = EISDIR;
+        return -1;
+    }
+    return pma_memfs_remove(arg, path);
+}
+
+static char *
+memfs_realpath(void *arg, const char *path)
+{
+    node_t *n;
+    char *abs;
+
+    if (!(n = lookup(arg, path))) {
+        return NULL;
+    }
+    if (asprintf(&abs, "%s%s%s", MEMFS_ROOT, *n->path ? "/" : "",
+                n->path) == -1) {
+        return NULL;
+    }
+    return abs;
+}
+
+static void
+memfs_now(void *arg, struct timespec *ts)
+{
+    *ts = ((pma_memfs_t *)arg)->clock;
+}
+
+void
+pma_memfs_fsops(pma_memfs_t *m, pma_fsops_t *ops)
+{
+    ops->size = sizeof(*ops);
+    ops->arg = m;
+    ops->opendir = memfs_opendir;
+    ops->readdir = memfs_readdir;
+    ops->closedir = memfs_closedir;
+    ops->stat = memfs_stat;
+    ops->set_times = memfs_set_times;
+    ops->create = memfs_create;
+    ops->read = memfs_read;
+    ops->unlink = memfs_unlink;
+    ops->realpath = memfs_realpath;
+    ops->now = memfs_now;
+}
+
+// vim: ts=8:sw=4:tw=80:et:
@@ -0,0 +1,740 @@
+/******************************************************************************
+ * Copyright (C) 2010-2018 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * pma_hasher: content hashing for the front ends, which use it for
+ * restat, the action cache and memos, and to tell whether a file was
+ * changed within one timestamp granule.
+ *
+ * The default "vh128" algorithm is a non-cryptographic 128-bit hash
+ * built on 32x32->64 bit multiplies over 64-byte stripes, written with
+ * vector types so each stripe is a handful of SIMD ops. "sha256" is
+ * there for when a cryptographic digest is wanted. Files larger than
+ * one chunk are mapped and their chunks hashed in parallel, after
+ * which the file digest is the hash of the chunk digests. Results are
+ * host-endian and meant only for local caches and comparisons.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <search.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libpmaudit.h"
+
+#define HASH_CHUNK (4UL << 20)
+#define HASH_MAXTHREADS 8
+
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+static const uint64_t vh_secret[24] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL,
+    0x1f67b3b7a4a44072ULL, 0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+    0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL, 0xcb00c391bb52283cULL,
+    0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+    0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL, 0x3159b4cd4be0518aULL,
+    0x647378d9c97e9fc8ULL, 0xc3ebd33483acc5eaULL, 0xeb6313faffa081c5ULL,
+    0x49daf0b751dd0d17ULL, 0x9e68d429265516d3ULL, 0xfca1477d58be162bULL,
+    0xce31d07ad1b8f88fULL, 0x280416958f3acb45ULL, 0x7e404bbbcafbd7afULL,
+};
+
+#define VH_PRIME32 0x9E3779B1ULL
+#define VH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define VH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define VH_STRIPE 64
+#define VH_BLOCK_STRIPES 16
+
+typedef struct {
+    v4u64 acc[2];
+    uint64_t len;
+} vh_state_t;
+
+static void
+vh_init(vh_state_t *st)
+{
+    st->acc[0] = (v4u64){VH_PRIME32, VH_PRIME64_1, VH_PRIME64_2, VH_PRIME32};
+    st->acc[1] = (v4u64){VH_PRIME64_2, VH_PRIME32, VH_PRIME64_1, VH_PRIME64_2};
+    st->len = 0;
+}
+
+/*
+ * Consume whole stripes. Like XXH3, each stripe position in a block
+ * takes its key from the secret one word further along than the last,
+ * so no two positions share a key and reordering stripes changes the
+ * result; st->len counts stripes so a later call continues the walk.
+ */
+static void
+vh_stripes(vh_state_t *st, const unsigned char *p, size_t nstripes)
+{
+    v4u64 acc0 = st->acc[0], acc1 = st->acc[1];
+    size_t i;
+
+    for (i = 0; i < nstripes; i++, p += VH_STRIPE) {
+        size_t pos = (st->len + i) % VH_BLOCK_STRIPES;
+        const uint64_t *s = vh_secret + pos;
+        v4u64 d0, d1, k0, k1, key0, key1;
+
+        memcpy(&d0, p, sizeof(d0));
+        memcpy(&d1, p + sizeof(d0), sizeof(d1));
+        memcpy(&key0, s, sizeof(key0));
+        memcpy(&key1, s + 4, sizeof(key1));
+        k0 = d0 ^ key0;
+        k1 = d1 ^ key1;
+        // Multiplication loses input bits so add the raw data in too.
+        acc0 += (k0 & 0xffffffffULL) * (k0 >> 32) + d1;
+        acc1 += (k1 & 0xffffffffULL) * (k1 >> 32) + d0;
+        if (pos == VH_BLOCK_STRIPES - 1) {
+            memcpy(&key0, vh_secret + 16, sizeof(key0));
+            memcpy(&key1, vh_secret + 20, sizeof(key1));
+            acc0 = ((acc0 ^ (acc0 >> 47)) ^ key0) * VH_PRIME32;
+            acc1 = ((acc1 ^ (acc1 >> 47)) ^ key1) * VH_PRIME32;
+        }
+    }
+    st->len += nstripes;
+    st->acc[0] = acc0;
+    st->acc[1] = acc1;
+}
+
+static uint64_t
+vh_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= VH_PRIME64_2;
+    h ^= h >> 29;
+    h *= VH_PRIME64_1;
+    h ^= h >> 32;
+    return h;
+}
+
+static void
+vh_buf(const void *buf, size_t len, unsigned char out[16])
+{
+    unsigned char tail[VH_STRIPE];
+    size_t whole = len / VH_STRIPE;
+    uint64_t lanes[8], h1, h2;
+    vh_state_t st;
+    int i;
+
+    vh_init(&st);
+    vh_stripes(&st, buf, whole);
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, (const unsigned char *)buf + whole * VH_STRIPE,
+            len - whole * VH_STRIPE);
+    vh_stripes(&st, tail, 1);
+    memcpy(lanes, st.acc, sizeof(lanes));
+    h1 = len * VH_PRIME64_1;
+    h2 = ~len * VH_PRIME64_2;
+    for (i = 0; i < 8; i++) {
+        h1 = vh_avalanche(h1 ^ (lanes[i] + vh_secret[i]));
+        h2 = vh_avalanche(h2 + (lanes[i] ^ vh_secret[i + 8]) * VH_PRIME32);
+    }
+    h2 ^= h1 >> 1;
+    memcpy(out, &h1, sizeof(h1));
+    memcpy(out + sizeof(h1), &h2, sizeof(h2));
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(uint32_t h[8], const unsigned char *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, hh, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+            (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (; i < 64; i++) {
+        w[i] = w[i - 16] + w[i - 7] +
+            (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+            (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+    for (i = 0; i < 64; i++) {
+        t1 = hh + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+            ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+            ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+static void
+sha256_buf(const void *buf, size_t len, unsigned char out[32])
+{
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    const unsigned char *p = buf;
+    unsigned char tail[128];
+    size_t rest, padlen;
+    uint64_t bits = (uint64_t)len * 8;
+    int i;
+
+    for (; len >= 64; len -= 64, p += 64) {
+        sha256_block(h, p);
+    }
+    rest = len;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, p, rest);
+    tail[rest] = 0x80;
+    padlen = rest < 56 ? 64 : 128;
+    for (i = 0; i < 8; i++) {
+        tail[padlen - 1 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    sha256_block(h, tail);
+    if (padlen == 128) {
+        sha256_block(h, tail + 64);
+    }
+    for (i = 0; i < 32; i++) {
+        out[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+
+static const struct {
+    const char *name;
+    unsigned len;
+    void (*fn)(const void *, size_t, unsigned char *);
+} hash_algos[] = {
+    {"vh128", 16, (void (*)(const void *, size_t, unsigned char *))vh_buf},
+    {"sha256", 32, (void (*)(const void *, size_t, unsigned char *))sha256_buf},
+};
+
+#define NALGOS (sizeof(hash_algos) / sizeof(hash_algos[0]))
+
+/*
+ * The fingerprint cache remembers the hash of each file by (dev, ino)
+ * along with the mtime, ctime and size it had when hashed, so files
+ * that haven't changed are never read again. It's kept on disk as a
+ * flat array of these records and merged with the current file on save.
+ */
+
+#define FPRINT_MAGIC "PMHC0002"
+
+typedef struct {
+    uint64_t dev, ino, size;
+    int64_t mtime_sec, ctime_sec;
+    uint32_t mtime_nsec, ctime_nsec;
+    uint8_t algo, len, pad[6];
+    unsigned char hash[32];
+} fprint_t;
+
+struct pma_hasher {
+    unsigned algo;
+    unsigned nthreads;
+    long gran;
+    char *file;                 // of the fingerprint cache, if any
+    void *tree;                 // fingerprints by (dev, ino, algo)
+    fprint_t **recs;            // the same, for writing and freeing
+    size_t nrecs, caprecs;
+    int dirty;
+    pma_hash_counters_t ctr;
+};
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+pma_hash_buf(const pma_hasher_t *h, const void *buf, size_t len,
+        pma_digest_t *d)
+{
+    d->len = hash_algos[h->algo].len;
+    hash_algos[h->algo].fn(buf, len, d->b);
+}
+
+typedef struct {
+    const pma_hasher_t *h;
+    const unsigned char *base;
+    size_t size, nchunks;
+    unsigned first, stride;
+    pma_digest_t *digests;
+} hash_job_t;
+
+static void *
+hash_chunks(void *arg)
+{
+    hash_job_t *job = arg;
+    size_t i, len;
+
+    for (i = job->first; i < job->nchunks; i += job->stride) {
+        len = job->size - i * HASH_CHUNK;
+        pma_hash_buf(job->h, job->base + i * HASH_CHUNK,
+                len < HASH_CHUNK ? len : HASH_CHUNK, &job->digests[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Hash a file that's been mapped into memory, spreading its chunks
+ * across threads when there's more than one.
+ */
+static int
+hash_mapped(const pma_hasher_t *h, const unsigned char *base, size_t size,
+        pma_digest_t *d)
+{
+    hash_job_t jobs[HASH_MAXTHREADS];
+    pthread_t tids[HASH_MAXTHREADS];
+    size_t nchunks = (size + HASH_CHUNK - 1) / HASH_CHUNK;
+    unsigned t, nthreads;
+    unsigned char *cat;
+    pma_digest_t *digests;
+    uint64_t size64 = size;
+
+    if (nchunks <= 1) {
+        pma_hash_buf(h, base, size, d);
+        return 0;
+    }
+    if (!(digests = calloc(nchunks, sizeof(pma_digest_t)))) {
+        return -1;
+    }
+    nthreads = nchunks < h->nthreads ? nchunks : h->nthreads;
+    for (t = 0; t < nthreads; t++) {
+        jobs[t].h = h;
+        jobs[t].base = base;
+        jobs[t].size = size;
+        jobs[t].nchunks = nchunks;
+        jobs[t].first = t;
+        jobs[t].stride = nthreads;
+        jobs[t].digests = digests;
+        if (t && pthread_create(&tids[t], NULL, hash_chunks, &jobs[t])) {
+            // No more threads to be had; give their chunks to the rest.
+            nthreads = t;
+            for (t = 0; t < nthreads; t++) {
+                jobs[t].stride = nthreads;
+            }
+            break;
+        }
+    }
+    hash_chunks(&jobs[0]);
+    for (t = 1; t < nthreads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    // Fold the chunk digests together, prefixed by the file size.
+    if (!(cat = malloc(sizeof(uint64_t) + nchunks * digests[0].len))) {
+        free(digests);
+        return -1;
+    }
+    memcpy(cat, &size64, sizeof(uint64_t));
+    for (t = 0; t < nchunks; t++) {
+        memcpy(cat + sizeof(uint64_t) + t * digests[0].len, digests[t].b,
+                digests[0].len);
+    }
+    pma_hash_buf(h, cat, sizeof(uint64_t) + nchunks * digests[0].len, d);
+    free(cat);
+    free(digests);
+    return 0;
+}
+
+static int
+fprintcmp(const void *pa, const void *pb)
+{
+    const fprint_t *a = pa, *b = pb;
+
+    if (a->dev != b->dev) {
+        return a->dev < b->dev ? -1 : 1;
+    } else if (a->ino != b->ino) {
+        return a->ino < b->ino ? -1 : 1;
+    }
+    return (int)a->algo - (int)b->algo;
+}
+
+static void
+fprint_stamp(const pma_hasher_t *h, fprint_t *f, const struct stat *sb)
+{
+    f->dev = sb->st_dev;
+    f->ino = sb->st_ino;
+    f->size = sb->st_size;
+    f->mtime_sec = sb->st_mtime;
+    f->mtime_nsec = sb->st_mtim.tv_nsec;
+    f->ctime_sec = sb->st_ctime;
+    f->ctime_nsec = sb->st_ctim.tv_nsec;
+    f->algo = h->algo;
+}
+
+static fprint_t *
+fprint_find(const pma_hasher_t *h, const struct stat *sb)
+{
+    fprint_t key;
+    void *px;
+
+    memset(&key, 0, sizeof(key));
+    fprint_stamp(h, &key, sb);
+    px = tfind((const void *)&key, &h->tree, fprintcmp);
+    return px ? *((fprint_t **)px) : NULL;
+}
+
+static int
+fprint_valid(const fprint_t *f, const struct stat *sb)
+{
+    return f->size == (uint64_t)sb->st_size &&
+        f->mtime_sec == sb->st_mtime &&
+        f->mtime_nsec == (uint32_t)sb->st_mtim.tv_nsec &&
+        f->ctime_sec == sb->st_ctime &&
+        f->ctime_nsec == (uint32_t)sb->st_ctim.tv_nsec;
+}
+
+static int
+fprint_insert(pma_hasher_t *h, const fprint_t *rec, int replace)
+{
+    fprint_t *f, **recs;
+    void *px;
+
+    if (h->nrecs == h->caprecs) {
+        size_t cap = h->caprecs ? h->caprecs * 2 : 1024;
+
+        if (!(recs = realloc(h->recs, cap * sizeof(*recs)))) {
+            return -1;
+        }
+        h->recs = recs;
+        h->caprecs = cap;
+    }
+    if (!(f = malloc(sizeof(*f)))) {
+        return -1;
+    }
+    memcpy(f, rec, sizeof(*f));
+    if (!(px = tsearch((const void *)f, &h->tree, fprintcmp))) {
+        free(f);
+        return -1;
+    }
+    if (*((fprint_t **)px) != f) {
+        if (replace) {
+            memcpy(*((fprint_t **)px), rec, sizeof(*f));
+        }
+        free(f);
+    } else {
+        h->recs[h->nrecs++] = f;
+    }
+    return 0;
+}
+
+static int
+fprint_read(pma_hasher_t *h)
+{
+    FILE *ffp;
+    char magic[8];
+    fprint_t rec;
+    int rc = 0;
+
+    if ((ffp = fopen(h->file, "r")) == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    // A cache from another version is ignored and replaced.
+    if (fread(magic, sizeof(magic), 1, ffp) == 1 &&
+            !memcmp(magic, FPRINT_MAGIC, sizeof(magic))) {
+        while (!rc && fread(&rec, sizeof(rec), 1, ffp) == 1) {
+            if (rec.algo < NALGOS) {
+                rc = fprint_insert(h, &rec, 0);
+            }
+        }
+    }
+    fclose(ffp);
+    return rc;
+}
+
+/*
+ * True if a file's mtime is so recent, relative to ref, that a later
+ * write within the same timestamp granule could leave it unchanged.
+ * One granule of slack covers the kernel's coarse file clock lagging
+ * behind the clock ref was read from.
+ */
+static int
+is_racy(const pma_hasher_t *h, const struct timespec *mtime,
+        const struct timespec *ref)
+{
+    int64_t refns, mns;
+
+    if (h->gran <= 1) {
+        return 0;
+    }
+    refns = (int64_t)ref->tv_sec * 1000000000LL + ref->tv_nsec - h->gran;
+    mns = (int64_t)mtime->tv_sec * 1000000000LL + mtime->tv_nsec;
+    return mns >= refns - refns % h->gran;
+}
+
+static int
+hash_path(pma_hasher_t *h, const char *path, pma_digest_t *d, int usecache)
+{
+    struct stat sb;
+    struct timespec now;
+    fprint_t *f, rec;
+    uint64_t start;
+    void *base;
+    int fd, rc = 0;
+
+    usecache = usecache && h->file;
+    if (usecache && stat(path, &sb) != -1 &&
+            (f = fprint_find(h, &sb)) && fprint_valid(f, &sb)) {
+        d->len = f->len;
+        memcpy(d->b, f->hash, f->len);
+        h->ctr.hits++;
+        return 0;
+    }
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return -1;
+    }
+    start = monotonic_ns();
+    if (sb.st_size > 0 && (base = mmap(NULL, sb.st_size, PROT_READ,
+                    MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        (void)madvise(base, sb.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+        rc = hash_mapped(h, base, sb.st_size, d);
+        munmap(base, sb.st_size);
+    } else {
+        // Not mappable (empty, or a special file): read it whole.
+        size_t cap = 1 << 20, len = 0;
+        unsigned char *buf = malloc(cap), *nbuf;
+        ssize_t n = 0;
+
+        while (buf && (n = read(fd, buf + len, cap - len)) > 0) {
+            len += n;
+            if (len == cap) {
+                if (!(nbuf = realloc(buf, cap *= 2))) {
+                    free(buf);
+                }
+                buf = nbuf;
+            }
+        }
+        if (!buf || n == -1) {
+            rc = -1;
+        } else {
+            pma_hash_buf(h, buf, len, d);
+        }
+        free(buf);
+    }
+    close(fd);
+    if (rc == -1) {
+        return -1;
+    }
+    h->ctr.nsecs += monotonic_ns() - start;
+    h->ctr.files++;
+    h->ctr.bytes += sb.st_size;
+    // Like racy-git: a stat match can't vouch for a just-written file.
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (usecache && !is_racy(h, &sb.st_mtim, &now)) {
+        memset(&rec, 0, sizeof(rec));
+        fprint_stamp(h, &rec, &sb);
+        rec.len = d->len;
+        memcpy(rec.hash, d->b, d->len);
+        if (fprint_insert(h, &rec, 1) == -1) {
+            return -1;
+        }
+        h->dirty = 1;
+    }
+    return 0;
+}
+
+pma_hasher_t *
+pma_hasher_new(const char *algo)
+{
+    pma_hasher_t *h;
+    unsigned i;
+
+    for (i = 0; i < NALGOS && strcmp(algo, hash_algos[i].name); i++);
+    if (i == NALGOS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(h = calloc(1, sizeof(*h)))) {
+        return NULL;
+    }
+    h->algo = i;
+    h->nthreads = 1;
+    h->gran = 1;
+    return h;
+}
+
+void
+pma_hasher_free(pma_hasher_t *h)
+{
+    size_t i;
+
+    if (!h) {
+        return;
+    }
+    // Empty the tree before its nodes' keys go.
+    while (h->tree) {
+        tdelete(*(fprint_t **)h->tree, &h->tree, fprintcmp);
+    }
+    for (i = 0; i < h->nrecs; i++) {
+        free(h->recs[i]);
+    }
+    free(h->recs);
+    free(h->file);
+    free(h);
+}
+
+const char *
+pma_hasher_algo(const pma_hasher_t *h)
+{
+    return hash_algos[h->algo].name;
+}
+
+unsigned
+pma_hasher_len(const pma_hasher_t *h)
+{
+    return hash_algos[h->algo].len;
+}
+
+void
+pma_hasher_set_threads(pma_hasher_t *h, unsigned n)
+{
+    h->nthreads = n < 1 ? 1 : n > HASH_MAXTHREADS ? HASH_MAXTHREADS : n;
+}
+
+void
+pma_hasher_set_granularity(pma_hasher_t *h, long ns)
+{
+    h->gran = ns > 0 ? ns : 1;
+}
+
+int
+pma_hasher_cache(pma_hasher_t *h, const char *file)
+{
+    free(h->file);
+    if (!(h->file = strdup(file))) {
+        return -1;
+    }
+    return fprint_read(h);
+}
+
+int
+pma_hasher_save(pma_hasher_t *h)
+{
+    char *tmpf;
+    FILE *ffp;
+    size_t i;
+    int rc = 0;
+
+    if (!h->file || !h->dirty) {
+        return 0;
+    }
+    // Pick up whatever other runs have added since we loaded.
+    if (fprint_read(h) == -1 ||
+            asprintf(&tmpf, "%s.%ld.tmp", h->file, (long)getpid()) == -1) {
+        return -1;
+    }
+    if (!(ffp = fopen(tmpf, "w"))) {
+        free(tmpf);
+        return -1;
+    }
+    if (fwrite(FPRINT_MAGIC, 8, 1, ffp) != 1) {
+        rc = -1;
+    }
+    for (i = 0; !rc && i < h->nrecs; i++) {
+        if (fwrite(h->recs[i], sizeof(fprint_t), 1, ffp) != 1) {
+            rc = -1;
+        }
+    }
+    if (fclose(ffp) == EOF || rc == -1 || rename(tmpf, h->file) == -1) {
+        (void)unlink(tmpf);
+        rc = -1;
+    } else {
+        h->dirty = 0;
+    }
+    free(tmpf);
+    return rc;
+}
+
+int
+pma_hash_file(pma_hasher_t *h, const char *path, pma_digest_t *d)
+{
+    return hash_path(h, path, d, 1);
+}
+
+int
+pma_hasher_hook(void *arg, const char *path, unsigned char *digest)
+{
+    pma_digest_t d;
+
+    if (hash_path(arg, path, &d, 0) == -1) {
+        return -1;
+    }
+    memcpy(digest, d.b, d.len);
+    return d.len;
+}
+
+/*
+ * Setting a file's times moves its ctime, which would invalidate its
+ * fingerprint. When the content is known not to have changed, carry
+ * the fingerprint over to the new times.
+ */
+void
+pma_hasher_retimed(void *arg, const char *path, const struct stat *before)
+{
+    pma_hasher_t *h = arg;
+    struct stat sb;
+    fprint_t *f;
+
+    if (!h->file || !(f = fprint_find(h, before)) || !fprint_valid(f, before)) {
+        return;
+    }
+    if (stat(path, &sb) != -1 && sb.st_dev == before->st_dev &&
+            sb.st_ino == before->st_ino && sb.st_size == before->st_size) {
+        fprint_stamp(h, f, &sb);
+        h->dirty = 1;
+    }
+}
+
+void
+pma_hasher_get_counters(const pma_hasher_t *h, pma_hash_counters_t *c)
+{
+    *c = h->ctr;
+}
+
+// vim: ts=8:sw=4:tw=80:et:
@@ -19,31 +19,72 @@
 #define _DARWIN_C_SOURCE
 
 #include <string.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <poll.h>
+#include <regex.h>
 #include <search.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "libpmaudit.h"
 
 #define TMFMT "a1=%010ld.%09ld m1=%010ld.%09ld a2=%010ld.%09ld m2=%010ld.%09ld"
 
-#define NOPENFD 20
+#define MEMO_MAGIC "pmash-memo 2"
+
+#define SESSION_ENV "PMAUDIT_SESSION"
+#define MARKER_ENV "PMAUDIT_MARKER"
+
+/*
+ * Trace records are fixed-size lines of text appended with one write,
+ * so that every pmash of a build may share a trace file unlocked:
+ *
+ *     B|E <monotonic ns> <pid> <ppid> <phase> <target>
+ *
+ * padded with spaces. Targets too long to fit are truncated.
+ */
+#define TRACE_RECSZ 256
 
-static char short_opts[] = "c:d:eVW:";
+static char short_opts[] = "A:B:C:c:d:eHIK:LM:m:o:pR:St:VW:X:";
 static struct option long_opts[] = {
+   {"hash-algo", required_argument, NULL, 'A'},
+   {"memory-budget", required_argument, NULL, 'B'},
+   {"cache", required_argument, NULL, 'C'},
    {"command", required_argument, NULL, 'c'},
    {"depsfile", required_argument, NULL, 'd'},
    {"errexit", no_argument, NULL, 'e'},
+   {"content-hash", no_argument, NULL, 'H'},
+   {"inode-order", no_argument, NULL, 'I'},
+   {"hash-cache", required_argument, NULL, 'K'},
+   {"cache-link", no_argument, NULL, 'L'},
+   {"memo", required_argument, NULL, 'M'},
+   {"mark", required_argument, NULL, 'm'},
+   {"outputs", required_argument, NULL, 'o'},
+   {"phases", no_argument, NULL, 'p'},
+   {"restat", required_argument, NULL, 'R'},
+   {"stats", optional_argument, NULL, 'S'},
+   {"trace", required_argument, NULL, 't'},
    {"verbose", no_argument, NULL, 'V'},
    {"watch", required_argument, NULL, 'W'},
+   {"skip-rules", required_argument, NULL, 'X'},
    {"help", no_argument, NULL, 'h'},
    {NULL, 0, NULL, 0}
 };
@@ -52,16 +93,41 @@ static const char *prog = "??";
 
 typedef struct {
     const char *path;
-    struct timespec times1[2];
-    struct timespec times2[2];
-} pathentry_s;
+    pma_digest_t hash;
+    struct timespec mtime;
+} outentry_s;
+
+typedef struct {
+    char *label;
+    char **paths;
+    size_t count;
+} phase_s;
 
-static void *tree1, *tree2;
+static pma_snapshot_t *snap;
 
 static FILE *fp;
 static char *depsfile;
 static unsigned verbosity;
 static unsigned prq_count;
+static int hflag;
+static FILE *auxfp;
+static FILE *keyfp;
+static char *keybuf;
+static size_t keylen;
+static char *cachedir;
+static int cachelink;
+static void *outtree;
+static unsigned out_count, restat_count;
+static char *session;
+static int session_owner;
+static off_t session_mark;
+static FILE *reportfp;
+static char *markerfile;
+static phase_s *phases, *cur_phase;
+static size_t phase_count;
+static int sigchld_pipe[2];
+static int trace_fd = -1;
+static char *trace_target;
 
 static void
 usage(int rc)
@@ -71,14 +137,38 @@ usage(int rc)
 
     fprintf(f, "Usage: %s -c <cmd> [-d <depsfile>] [-W dir[,dir,...]]\n", prog);
     fprintf(f, fmt, "-h/--help", "Print this usage summary");
+    fprintf(f, fmt, "-A/--hash-algo", "Content hash: vh128 (default) or sha256");
+    fprintf(f, fmt, "-B/--memory-budget", "Spill the snapshot to $TMPDIR past SIZE[kMG] (also $PMASH_MEMORY_BUDGET)");
+    fprintf(f, fmt, "-C/--cache", "Restore outputs from/save them to this action cache");
     fprintf(f, fmt, "-c/--command", "Command to invoke");
     fprintf(f, fmt, "-d/--depsfile", "File path to save dependency list");
     fprintf(f, fmt, "-e/--errexit", "Exit on first error");
+    fprintf(f, fmt, "-H/--content-hash", "Compare content when memo mtimes differ");
+    fprintf(f, fmt, "-I/--inode-order", "Scan in inode order for a cold cache (also $PMASH_COLD_CACHE)");
+    fprintf(f, fmt, "-K/--hash-cache", "Reuse hashes of unchanged files kept in this file");
+    fprintf(f, fmt, "-L/--cache-link", "Restore cached outputs as read-only hard links (also $PMASH_CACHE_LINK)");
+    fprintf(f, fmt, "-M/--memo", "Skip cmd if inputs recorded in this file are unchanged");
+    fprintf(f, fmt, "-m/--mark", "Start phase LABEL of the enclosing audit, then run cmd unaudited");
+    fprintf(f, fmt, "-o/--outputs", "File path to save list of files written");
+    fprintf(f, fmt, "-p/--phases", "Write a rule per phase marked by the command to the depsfile");
+    fprintf(f, fmt, "-R/--restat", "Keep old mtimes of unchanged outputs, hashed in this file");
+    fprintf(f, fmt, "-S/--stats[=FILE]", "Append a JSON line of statistics to FILE (default stderr)");
+    fprintf(f, fmt, "-t/--trace", "Append phase begin/end records to this trace file");
     fprintf(f, fmt, "-V/--verbose", "Bump verbosity mode");
     fprintf(f, fmt, "-W/--watch", "Directories to monitor (default='.')");
+    fprintf(f, fmt, "-X/--skip-rules", "Run cmds matching rules in this file unaudited");
     fprintf(f, "\nEXAMPLES:\n\n");
     fprintf(f, "Compile foo.o leaving prereq data in foo.o.d:\n\n");
     fprintf(f, "    %s --depsfile=foo.o.d -c 'gcc -c foo.c'\n", prog);
+    fprintf(f, "\nAs above but don't rerun gcc while foo.o's audited inputs are unchanged:\n\n");
+    fprintf(f, "    %s -d foo.o.d -M foo.o.memo -c 'gcc -c foo.c'\n", prog);
+    fprintf(f, "\nRun trivial commands unaudited and audit only objects and libraries,\n"
+            "given a file of rules (also $PMASH_SKIP_RULES) such as:\n\n");
+    fprintf(f, "    cmd ^[[:space:]]*(mkdir -p|echo|touch|rm -f|:)([[:space:]]|$)\n");
+    fprintf(f, "    only *.o,*.a\n");
+    fprintf(f, "\nAudit a whole make once, with a rule per target in make.d:\n\n");
+    fprintf(f, "    %s -p -d make.d -c \"make SHELL=%s .SHELLFLAGS='-m \\$@ -c'\"\n",
+            prog, prog);
     exit(rc);
 }
 
@@ -98,151 +188,1338 @@ insist(int success, const char *term)
     }
 }
 
+// Die on a failed libpmaudit call.
+static void
+check(int rc)
+{
+    if (rc == -1) {
+        die((char *)pma_error(snap));
+    }
+}
+
+// Leave a file of ours, if named, out of the audit.
+static void
+exclude_own(const char *path)
+{
+    if (path) {
+        check(pma_exclude_path(snap, path));
+    }
+}
+
+// A byte count with an optional k, M or G suffix.
+static size_t
+parse_size(const char *str)
+{
+    unsigned long long n;
+    char *end;
+
+    n = strtoull(str, &end, 10);
+    switch (*end) {
+        case 'G': case 'g':
+            n <<= 10;
+            // fall through
+        case 'M': case 'm':
+            n <<= 10;
+            // fall through
+        case 'K': case 'k':
+            n <<= 10;
+            end++;
+            break;
+    }
+    if (end == str || *end) {
+        die("bad size");
+    }
+    return n;
+}
+
 static int
-pathcmp(const void *pa, const void *pb)
+strvcmp(const void *pa, const void *pb)
 {
-    return strcmp(((pathentry_s *)pa)->path, ((pathentry_s *)pb)->path);
+    return strcmp(*(char *const *)pa, *(char *const *)pb);
 }
 
+static uint64_t
+fnv1a(uint64_t h, const void *buf, size_t len)
+{
+    const unsigned char *c = buf;
+
+    while (len--) {
+        h ^= *c++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define FNV_INIT 0xcbf29ce484222325ULL
+
+static pma_hasher_t *hasher;
+static char *fprintfile;
+static struct rusage child_ru;
+
 static int
-nftw_pre_callback(const char *fpath, const struct stat *sb,
-        int tflag, struct FTW *ftwbuf)
+hash_eq(const pma_digest_t *a, const pma_digest_t *b)
 {
-    pathentry_s *p1;
+    return a->len == b->len && !memcmp(a->b, b->b, a->len);
+}
 
-    (void)ftwbuf; /* unused */
+static char *
+hash_hex(const pma_digest_t *h, char buf[65])
+{
+    unsigned i;
 
-    /* We're only interested in files. */
-    if (tflag != FTW_F) {
-        return 0;
+    for (i = 0; i < h->len; i++) {
+        sprintf(buf + 2 * i, "%02x", h->b[i]);
     }
+    buf[2 * i] = '\0';
+    return buf;
+}
 
-    if (strstr(fpath, ".git") || strstr(fpath, ".svn") || strstr(fpath, ".swp")) {
-        return 0;
+static int
+hash_parse(const char *hex, pma_digest_t *h)
+{
+    unsigned i, byte;
+
+    h->len = pma_hasher_len(hasher);
+    for (i = 0; i < h->len; i++) {
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        h->b[i] = (unsigned char)byte;
     }
+    return isxdigit((unsigned char)hex[2 * i]) ? -1 : 0;
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    if (fpath[0] == '.' && fpath[1] == '/') {
-        fpath += 2;
+static void
+trace_event(char type, const char *phase, uint64_t ns)
+{
+    char rec[TRACE_RECSZ], *c;
+    int n;
+
+    if (trace_fd == -1) {
+        return;
+    }
+    n = snprintf(rec, sizeof(rec), "%c %llu %ld %ld %s %s", type,
+            (unsigned long long)ns, (long)getpid(), (long)getppid(), phase,
+            trace_target ? trace_target : "-");
+    if (n < 0 || n >= (int)sizeof(rec)) {
+        n = sizeof(rec) - 1;
+    }
+    memset(rec + n, ' ', sizeof(rec) - n);
+    for (c = rec; c < rec + n; c++) {
+        if (*c == '\n') {
+            *c = ' ';
+        }
     }
+    rec[sizeof(rec) - 1] = '\n';
+    // Failing to trace is no reason to fail the build.
+    (void)!write(trace_fd, rec, sizeof(rec));
+}
 
-    // Record atimes/mtimes but only after setting atimes behind mtimes
-    // for "relatime" reasons.
-    p1 = calloc(sizeof(pathentry_s), 1);
-    p1->path = strdup(fpath);
-    p1->times1[0].tv_sec = sb->st_mtime - 1;
-    p1->times1[0].tv_nsec = 0L;
-    p1->times1[1].tv_sec = sb->st_mtime;
-    p1->times1[1].tv_nsec = sb->st_mtim.tv_nsec;
-    insist(utimensat(AT_FDCWD, fpath, p1->times1, 0) != -1, fpath);
-    insist(tsearch((const void *)p1, &tree1, pathcmp) != NULL, "tsearch(&pre)");
+static void
+trace_begin(const char *phase)
+{
+    trace_event('B', phase, monotonic_ns());
+}
 
-    return 0;
+static void
+trace_end(const char *phase)
+{
+    trace_event('E', phase, monotonic_ns());
+}
+
+// However pmash exits, close the event spanning the whole run.
+static void
+trace_exit(void)
+{
+    trace_end("pmash");
 }
 
 static int
-nftw_post_callback(const char *fpath, const struct stat *sb,
-        int tflag, struct FTW *ftwbuf)
+hash_file(const char *path, pma_digest_t *h)
 {
-    const void *px;
-    pathentry_s *p1, *p2;
+    return pma_hash_file(hasher, path, h);
+}
 
-    (void)ftwbuf; /* unused */
+static void
+hash_save(void)
+{
+    insist(pma_hasher_save(hasher) != -1, fprintfile);
+}
 
-    /* We're only interested in files. */
-    if (tflag != FTW_F) {
-        return 0;
+static char *
+session_path(const char *name)
+{
+    char *path;
+
+    insist(asprintf(&path, "%s/%s", session, name) != -1, "asprintf()");
+    return path;
+}
+
+/*
+ * Tell enclosing audits that a file was read before we hide the
+ * evidence by pushing its atime back behind its mtime.
+ */
+static void
+session_report(void *arg, const char *abspath)
+{
+    char *log;
+
+    (void)arg;
+    if (!reportfp) {
+        log = session_path("touched");
+        insist((reportfp = fopen(log, "a")) != NULL, log);
+        setvbuf(reportfp, NULL, _IOLBF, 0);
+        free(log);
+    }
+    fprintf(reportfp, "R %s\n", abspath);
+}
+
+static char *
+chomp(char *line, ssize_t len)
+{
+    if (len < 0) {
+        len = strlen(line);
+    }
+    if (len > 0 && line[len - 1] == '\n') {
+        line[len - 1] = '\0';
+    }
+    return line;
+}
+
+static void
+memo_write(FILE *mfp)
+{
+    size_t cursor = 0;
+    pma_diff_t d;
+    char hex[65];
+    pma_digest_t hash;
+
+    while (pma_diff_next(snap, &cursor, &d)) {
+        if (d.category == PMA_PREREQ) {
+            fprintf(mfp, "P %ld.%09ld %lld ", (long)d.after[1].tv_sec,
+                    d.after[1].tv_nsec, (long long)d.size);
+            if (hflag && hash_file(d.path, &hash) != -1) {
+                fprintf(mfp, "%s ", hash_hex(&hash, hex));
+            } else {
+                fputs("- ", mfp);
+            }
+            fprintf(mfp, "%s\n", d.path);
+        } else if (d.category != PMA_UNUSED) {
+            fprintf(mfp, "T %s\n", d.path);
+        }
     }
+}
+
+static uint64_t
+memo_key(const char *cmdstr, const char *watchdirs)
+{
+    uint64_t key = FNV_INIT;
 
-    if (strstr(fpath, ".git") || strstr(fpath, ".svn") || strstr(fpath, ".swp")) {
+    key = fnv1a(key, cmdstr, strlen(cmdstr) + 1);
+    key = fnv1a(key, watchdirs, strlen(watchdirs) + 1);
+    return key;
+}
+
+/*
+ * Returns nonzero if the memo file records a successful run of the same
+ * command whose prereqs are all unchanged and whose outputs still exist.
+ */
+static int
+memo_check(const char *memofile, uint64_t key)
+{
+    FILE *mfp;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    int valid = 0;
+
+    if ((mfp = fopen(memofile, "r")) == NULL) {
         return 0;
     }
+    if (getline(&line, &linecap, mfp) <= 0 ||
+            strncmp(line, MEMO_MAGIC " ", strlen(MEMO_MAGIC) + 1) ||
+            strcmp(chomp(line + strlen(MEMO_MAGIC) + 1, -1),
+                pma_hasher_algo(hasher))) {
+        goto done;
+    }
+    if (getline(&line, &linecap, mfp) <= 0 || strncmp(line, "cmd ", 4) ||
+            strtoull(line + 4, NULL, 16) != key) {
+        goto done;
+    }
+    while ((len = getline(&line, &linecap, mfp)) > 0) {
+        struct stat sb;
+        long sec, nsec;
+        long long size;
+        char hashstr[65];
+        pma_digest_t hash, want;
+        int off = 0;
 
-    if (fpath[0] == '.' && fpath[1] == '/') {
-        fpath += 2;
+        chomp(line, len);
+        if (line[0] == 'T' && line[1] == ' ') {
+            if (stat(line + 2, &sb) == -1) {
+                goto done;
+            }
+            continue;
+        }
+        if (line[0] != 'P' || sscanf(line, "P %ld.%ld %lld %64s %n",
+                    &sec, &nsec, &size, hashstr, &off) != 4 || !off) {
+            goto done;
+        }
+        if (stat(line + off, &sb) == -1) {
+            goto done;
+        }
+        if (sb.st_mtime == sec && sb.st_mtim.tv_nsec == nsec &&
+                sb.st_size == size) {
+            continue;
+        }
+        // A touched but otherwise identical prereq is still unchanged.
+        if (!hflag || hash_parse(hashstr, &want) == -1 ||
+                sb.st_size != size || hash_file(line + off, &hash) == -1 ||
+                !hash_eq(&hash, &want)) {
+            goto done;
+        }
     }
+    valid = 1;
+
+done:
+    free(line);
+    fclose(mfp);
+    return valid;
+}
+
+static void
+memo_save(const char *memofile, uint64_t key)
+{
+    char *tmpf;
 
-    // Record atimes/mtimes but only after setting atime behind mtime
-    // for "relatime" reasons.
-    p2 = calloc(sizeof(pathentry_s), 1);
-    p2->path = strdup(fpath);
-    p2->times1[0].tv_sec = -2L;
-    p2->times1[1].tv_sec = -1L;
-    p2->times2[0].tv_sec = sb->st_atime;
-    p2->times2[0].tv_nsec = sb->st_atim.tv_nsec;
-    p2->times2[1].tv_sec = sb->st_mtime;
-    p2->times2[1].tv_nsec = sb->st_mtim.tv_nsec;
-    if ((px = tfind((const void *)p2, &tree1, pathcmp))) {
-        p1 = *((pathentry_s **)px);
-        p2->times1[0].tv_sec = p1->times1[0].tv_sec;
-        p2->times1[0].tv_nsec = p1->times1[0].tv_nsec;
-        p2->times1[1].tv_sec = p1->times1[1].tv_sec;
-        p2->times1[1].tv_nsec = p1->times1[1].tv_nsec;
+    insist(asprintf(&tmpf, "%s.%ld.tmp", memofile, (long)getpid()) != -1,
+            "asprintf()");
+    insist((auxfp = fopen(tmpf, "w")) != NULL, tmpf);
+    fprintf(auxfp, "%s %s\ncmd %016llx\n", MEMO_MAGIC,
+            pma_hasher_algo(hasher), (unsigned long long)key);
+    memo_write(auxfp);
+    insist(fclose(auxfp) != EOF, tmpf);
+    insist(rename(tmpf, memofile) != -1, memofile);
+    free(tmpf);
+}
+
+static void
+mkdirs(char *path)
+{
+    char *slash;
+
+    for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+            insist(0, path);
+        }
+        *slash = '/';
     }
-    insist(tsearch((const void *)p2, &tree2, pathcmp) != NULL, "tsearch(&post)");
+}
 
+/*
+ * Copy src to dst atomically, sharing extents via a reflink where
+ * the filesystem supports it. Hard links are only used when asked
+ * for, by link_file(), because some tools rewrite their outputs in
+ * place.
+ */
+static int
+copy_file(const char *src, const char *dst, mode_t mode)
+{
+    char buf[65536], *tmpf;
+    ssize_t n = 0;
+    int ifd, ofd;
+
+    if ((ifd = open(src, O_RDONLY)) == -1) {
+        return -1;
+    }
+    insist(asprintf(&tmpf, "%s.%ld.tmp", dst, (long)getpid()) != -1,
+            "asprintf()");
+    mkdirs(tmpf);
+    insist((ofd = open(tmpf, O_CREAT|O_WRONLY|O_TRUNC, 0600)) != -1, tmpf);
+#ifdef FICLONE
+    if (ioctl(ofd, FICLONE, ifd) == -1)
+#endif
+    {
+        while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+            insist(write(ofd, buf, n) == n, tmpf);
+        }
+    }
+    insist(n != -1, src);
+    insist(fchmod(ofd, mode) != -1, tmpf);
+    insist(close(ofd) != -1, tmpf);
+    (void)close(ifd);
+    insist(rename(tmpf, dst) != -1, dst);
+    free(tmpf);
     return 0;
 }
 
+/*
+ * With -L, restore an output that isn't executable as a hard link to
+ * its blob. Blobs are read-only, so a tool rewriting the output in
+ * place fails rather than corrupting the cache (unless run as root).
+ * The link's times are set to now as a copy's would be, which moves
+ * those of every other link to the blob too. Returns -1 where a copy
+ * must do, as across filesystems or for a blob we don't own.
+ */
 static int
-is_prereq(pathentry_s *p)
+link_file(const char *blob, const char *dst, mode_t mode)
 {
-    // If mtime has moved it's a target 
-    // and if atime hasn't moved it's unused.
-    if (p->times2[1].tv_sec > p->times1[1].tv_sec) {
-        return 0;
-    } else if (p->times2[1].tv_sec == p->times1[1].tv_sec &&
-               p->times2[1].tv_nsec > p->times1[1].tv_nsec) {
-        return 0;
-    } else if (p->times2[0].tv_sec <= p->times1[0].tv_sec) {
-        return 0;
-    } else if (p->times2[0].tv_sec == p->times1[0].tv_sec &&
-               p->times2[0].tv_nsec <= p->times1[0].tv_nsec) {
-        return 0;
-    } else {
-        return 1;
+    char *tmpf;
+    int rc = -1;
+
+    if (mode & 0111) {
+        return -1;
     }
+    insist(asprintf(&tmpf, "%s.%ld.tmp", dst, (long)getpid()) != -1,
+            "asprintf()");
+    mkdirs(tmpf);
+    if (link(blob, tmpf) != -1 && utimensat(AT_FDCWD, tmpf, NULL, 0) != -1 &&
+            rename(tmpf, dst) != -1) {
+        rc = 0;
+    }
+    // Left behind on failure, or if dst was already this link.
+    (void)unlink(tmpf);
+    free(tmpf);
+    return rc;
+}
+
+static char *
+cache_path(const char *kind, const char *hex, const char *suffix)
+{
+    char *cpath;
+
+    insist(asprintf(&cpath, "%s/%s/%.2s/%s%s", cachedir, kind, hex, hex,
+                suffix) != -1, "asprintf()");
+    return cpath;
+}
+
+static FILE *
+cache_create(const char *cpath, char **tmpf)
+{
+    FILE *cfp;
+
+    insist(asprintf(tmpf, "%s.%ld.tmp", cpath, (long)getpid()) != -1,
+            "asprintf()");
+    mkdirs(*tmpf);
+    insist((cfp = fopen(*tmpf, "w")) != NULL, *tmpf);
+    return cfp;
 }
 
 static void
-post_walk_1(const void *nodep, const VISIT which, const int depth)
+cache_commit(FILE *cfp, char *tmpf, char *cpath)
 {
-    pathentry_s *p = *((pathentry_s **)nodep);
+    insist(fclose(cfp) != EOF, tmpf);
+    insist(rename(tmpf, cpath) != -1, cpath);
+    free(tmpf);
+    free(cpath);
+}
 
-    (void)depth;
-    if ((which != postorder && which != leaf) || !is_prereq(p)) {
+/*
+ * The action key is the content hash of the command key followed
+ * by each prereq's path and content hash, accumulated in memory.
+ */
+static void
+akey_open(uint64_t cmdkey)
+{
+    insist((keyfp = open_memstream(&keybuf, &keylen)) != NULL,
+            "open_memstream()");
+    fwrite(&cmdkey, sizeof(cmdkey), 1, keyfp);
+}
+
+static void
+akey_add(const char *path, const pma_digest_t *hash)
+{
+    fwrite(path, strlen(path) + 1, 1, keyfp);
+    fwrite(hash->b, hash->len, 1, keyfp);
+}
+
+static char *
+akey_close(char hex[65])
+{
+    pma_digest_t akey;
+
+    insist(fclose(keyfp) != EOF, "open_memstream()");
+    pma_hash_buf(hasher, keybuf, keylen, &akey);
+    free(keybuf);
+    return hash_hex(&akey, hex);
+}
+
+static void
+cache_in_write(FILE *cfp)
+{
+    size_t cursor = 0;
+    pma_diff_t d;
+    pma_digest_t hash;
+
+    while (pma_diff_next(snap, &cursor, &d)) {
+        if (d.category != PMA_PREREQ) {
+            continue;
+        }
+        insist(hash_file(d.path, &hash) != -1, d.path);
+        akey_add(d.path, &hash);
+        fprintf(cfp, "%s\n", d.path);
+    }
+}
+
+static void
+cache_out_write(FILE *cfp)
+{
+    size_t cursor = 0;
+    struct stat sb;
+    pma_diff_t d;
+    char hex[65];
+    pma_digest_t hash;
+    char *blob;
+
+    while (pma_diff_next(snap, &cursor, &d)) {
+        if (d.category != PMA_INTERMEDIATE && d.category != PMA_FINAL) {
+            continue;
+        }
+        if (hash_file(d.path, &hash) == -1 || stat(d.path, &sb) == -1) {
+            continue;
+        }
+        blob = cache_path("cas", hash_hex(&hash, hex), "");
+        if (access(blob, R_OK) == -1) {
+            insist(copy_file(d.path, blob, 0444) != -1, d.path);
+        }
+        free(blob);
+        fprintf(cfp, "%o %s %s\n", (unsigned)(sb.st_mode & 07777), hex, d.path);
+    }
+}
+
+/*
+ * The cache is keyed in two steps. The command key names the list of
+ * prereqs it read last time, and the content of those prereqs hashes
+ * to the action key naming its outputs. Returns the number of outputs
+ * restored, or -1 on a cache miss.
+ */
+static int
+cache_fetch(uint64_t cmdkey)
+{
+    FILE *infp, *outfp = NULL;
+    char *cpath, *line = NULL;
+    char hex[65];
+    size_t linecap = 0;
+    ssize_t len;
+    pma_digest_t hash;
+    unsigned mode;
+    int off, pass, count = -1;
+
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)cmdkey);
+    cpath = cache_path("ac", hex, ".in");
+    infp = fopen(cpath, "r");
+    free(cpath);
+    if (!infp) {
+        return -1;
+    }
+    akey_open(cmdkey);
+    while ((len = getline(&line, &linecap, infp)) > 0) {
+        if (hash_file(chomp(line, len), &hash) == -1) {
+            akey_close(hex);
+            goto done;
+        }
+        akey_add(line, &hash);
+    }
+    cpath = cache_path("ac", akey_close(hex), ".out");
+    outfp = fopen(cpath, "r");
+    free(cpath);
+    if (!outfp) {
+        goto done;
+    }
+
+    // Make sure every blob is present before restoring any of them.
+    for (pass = 0; pass < 2; pass++) {
+        rewind(outfp);
+        while ((len = getline(&line, &linecap, outfp)) > 0) {
+            char *blob;
+
+            if (sscanf(chomp(line, len), "%o %64s %n", &mode, hex, &off) != 2) {
+                goto done;
+            }
+            blob = cache_path("cas", hex, "");
+            if (!pass && access(blob, R_OK) == -1) {
+                free(blob);
+                goto done;
+            } else if (pass) {
+                insist((cachelink && link_file(blob, line + off, mode) != -1) ||
+                        copy_file(blob, line + off, mode) != -1, blob);
+                check(pma_add(snap, line + off, PMA_FINAL));
+            }
+            free(blob);
+        }
+    }
+    rewind(infp);
+    while ((len = getline(&line, &linecap, infp)) > 0) {
+        check(pma_add(snap, chomp(line, len), PMA_PREREQ));
+    }
+    count = 0;
+    rewind(outfp);
+    while (getline(&line, &linecap, outfp) > 0) {
+        count++;
+    }
+
+done:
+    free(line);
+    if (outfp) {
+        fclose(outfp);
+    }
+    fclose(infp);
+    return count;
+}
+
+static void
+cache_store(uint64_t cmdkey)
+{
+    char *cpath, *tmpf;
+    char hex[65];
+    FILE *cfp;
+
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)cmdkey);
+    cpath = cache_path("ac", hex, ".in");
+    cfp = cache_create(cpath, &tmpf);
+    akey_open(cmdkey);
+    cache_in_write(cfp);
+    cache_commit(cfp, tmpf, cpath);
+
+    cpath = cache_path("ac", akey_close(hex), ".out");
+    cfp = cache_create(cpath, &tmpf);
+    cache_out_write(cfp);
+    cache_commit(cfp, tmpf, cpath);
+}
+
+static int
+outcmp(const void *pa, const void *pb)
+{
+    return strcmp(((outentry_s *)pa)->path, ((outentry_s *)pb)->path);
+}
+
+static void
+outputs_write(FILE *ofp)
+{
+    size_t cursor = 0;
+    pma_diff_t d;
+
+    while (pma_diff_next(snap, &cursor, &d)) {
+        if (d.category != PMA_INTERMEDIATE && d.category != PMA_FINAL) {
+            continue;
+        }
+        out_count++;
+        if (ofp) {
+            fprintf(ofp, "%s\n", d.path);
+        }
+    }
+}
+
+static void
+restat_load(const char *restatfile)
+{
+    FILE *rfp;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+
+    if ((rfp = fopen(restatfile, "r")) == NULL) {
         return;
     }
-    if (depsfile) {
-        if (prq_count++) {
-            fputs(" \\\n  ", fp);
-        } else {
-            const char *c, *e;
+    while ((len = getline(&line, &linecap, rfp)) > 0) {
+        char hex[65];
+        long sec, nsec;
+        outentry_s *o;
+        int off = 0;
+
+        if (sscanf(chomp(line, len), "%64s %ld.%ld %n",
+                    hex, &sec, &nsec, &off) != 3 || !off) {
+            continue;
+        }
+        o = calloc(sizeof(outentry_s), 1);
+        o->path = strdup(line + off);
+        if (hash_parse(hex, &o->hash) == -1) {
+            o->hash.len = 0;
+        }
+        o->mtime.tv_sec = sec;
+        o->mtime.tv_nsec = nsec;
+        insist(tsearch((const void *)o, &outtree, outcmp) != NULL,
+                "tsearch(&outputs)");
+    }
+    free(line);
+    fclose(rfp);
+}
+
+/*
+ * If a rebuilt target came out byte-identical to last time, put its
+ * old mtime back so make sees nothing new downstream of it. The
+ * target will look stale relative to whatever prereq triggered the
+ * rebuild, so its own recipe reruns next time (or is skipped via
+ * --memo) but the cascade stops there.
+ */
+static void
+restat_output(const pma_diff_t *d)
+{
+    outentry_s key, *o;
+    struct timespec times[2];
+    struct stat sb;
+    pma_digest_t hash;
+    void *px;
 
-            e = strrchr(depsfile, '.');
-            for (c = depsfile; c < e; c++) {
-                fputc(*c, fp);
+    if (hash_file(d->path, &hash) == -1) {
+        return;
+    }
+    key.path = d->path;
+    if ((px = tfind((const void *)&key, &outtree, outcmp))) {
+        o = *((outentry_s **)px);
+        if (hash_eq(&o->hash, &hash) &&
+                (o->mtime.tv_sec < d->after[1].tv_sec ||
+                 (o->mtime.tv_sec == d->after[1].tv_sec &&
+                  o->mtime.tv_nsec < d->after[1].tv_nsec))) {
+            times[0].tv_nsec = UTIME_OMIT;
+            times[1] = o->mtime;
+            insist(stat(d->path, &sb) != -1, d->path);
+            insist(utimensat(AT_FDCWD, d->path, times, 0) != -1, d->path);
+            pma_hasher_retimed(hasher, d->path, &sb);
+            restat_count++;
+            if (verbosity > 1) {
+                fprintf(stderr, "%s: unchanged: %s\n", prog, d->path);
             }
-            fputs(": \\\n  ", fp);
+            return;
         }
-        fputs(p->path, fp);
     } else {
-        fputs(p->path, fp);
-        fputc('\n', fp);
+        o = calloc(sizeof(outentry_s), 1);
+        o->path = strdup(d->path);
+        insist(tsearch((const void *)o, &outtree, outcmp) != NULL,
+                "tsearch(&outputs)");
     }
+    o->hash = hash;
+    o->mtime = d->after[1];
 }
 
 static void
-post_walk_2(const void *nodep, const VISIT which, const int depth)
+restat_save_walk(const void *nodep, const VISIT which, const int depth)
 {
-    pathentry_s *p = *((pathentry_s **)nodep);
+    outentry_s *o = *((outentry_s **)nodep);
+    char hex[65];
 
     (void)depth;
-    if ((which != postorder && which != leaf) || !is_prereq(p)) {
+    if (which != postorder && which != leaf) {
         return;
     }
-    if (depsfile) {
-        fprintf(fp, "\n%s:\n", p->path);
+    fprintf(auxfp, "%s %ld.%09ld %s\n", hash_hex(&o->hash, hex),
+            (long)o->mtime.tv_sec, o->mtime.tv_nsec, o->path);
+}
+
+static void
+restat(const char *restatfile)
+{
+    size_t cursor = 0;
+    pma_diff_t d;
+    char *tmpf;
+
+    restat_load(restatfile);
+    while (pma_diff_next(snap, &cursor, &d)) {
+        if (d.category == PMA_INTERMEDIATE || d.category == PMA_FINAL) {
+            restat_output(&d);
+        }
     }
+    insist(asprintf(&tmpf, "%s.%ld.tmp", restatfile, (long)getpid()) != -1,
+            "asprintf()");
+    insist((auxfp = fopen(tmpf, "w")) != NULL, tmpf);
+    twalk(outtree, restat_save_walk);
+    insist(fclose(auxfp) != EOF, tmpf);
+    insist(rename(tmpf, restatfile) != -1, restatfile);
+    free(tmpf);
+}
+
+/*
+ * Audits nest when pmaudit runs a make whose SHELL is pmash or when a
+ * pmash recipe runs a sub-make. They find each other through a session
+ * dir named in the environment holding an append-only log of files
+ * read ("touched") and the latest state of the tree ("snapshot").
+ * Whoever finds no session creates it and removes it when done.
+ */
+static void
+session_end(void)
+{
+    char *path;
+
+    path = session_path("touched");
+    (void)unlink(path);
+    free(path);
+    path = session_path("snapshot");
+    (void)unlink(path);
+    free(path);
+    (void)rmdir(session);
+}
+
+static void
+session_begin(void)
+{
+    struct stat sb;
+    const char *tmpdir;
+
+    if ((session = getenv(SESSION_ENV)) &&
+            stat(session, &sb) != -1 && S_ISDIR(sb.st_mode)) {
+        return;
+    }
+    if (!(tmpdir = getenv("TMPDIR"))) {
+        tmpdir = "/tmp";
+    }
+    insist(asprintf(&session, "%s/pmaudit.XXXXXX", tmpdir) != -1, "asprintf()");
+    insist(mkdtemp(session) != NULL, session);
+    insist(setenv(SESSION_ENV, session, 1) != -1, SESSION_ENV);
+    session_owner = 1;
+    atexit(session_end);
+}
+
+/*
+ * Work done outside an audit leaves the session's snapshot behind the
+ * tree, so the next nested audit has to prime afresh.
+ */
+static void
+session_drop(void)
+{
+    const char *dir;
+    char *path;
+
+    if ((dir = getenv(SESSION_ENV))) {
+        insist(asprintf(&path, "%s/snapshot", dir) != -1, "asprintf()");
+        (void)unlink(path);
+        free(path);
+    }
+}
+
+/*
+ * Note where the log ends when the command starts; what we reported
+ * ourselves while priming must not count as reads by the command.
+ */
+static void
+session_mark_log(void)
+{
+    struct stat sb;
+    char *log;
+
+    if (reportfp) {
+        fflush(reportfp);
+    }
+    log = session_path("touched");
+    session_mark = stat(log, &sb) != -1 ? sb.st_size : 0;
+    free(log);
+}
+
+// Collect reads reported by nested audits while the command ran.
+static void
+session_reads(void)
+{
+    FILE *f;
+    char *log, *line = NULL;
+    size_t n = 0;
+    ssize_t len;
+
+    log = session_path("touched");
+    if ((f = fopen(log, "r"))) {
+        insist(fseeko(f, session_mark, SEEK_SET) != -1, log);
+        while ((len = getline(&line, &n, f)) != -1) {
+            chomp(line, len);
+            if (line[0] == 'R' && line[1] == ' ') {
+                check(pma_note_read(snap, line + 2));
+            }
+        }
+        fclose(f);
+    }
+    free(line);
+    free(log);
+}
+
+/*
+ * As a nested audit, report and re-prime whatever the command read so
+ * the enclosing audit sees it, then leave our post-state as the
+ * snapshot the next nested audit can start from.
+ */
+static void
+session_handback(void)
+{
+    char *path;
+
+    path = session_path("snapshot");
+    check(pma_reprime(snap));
+    check(pma_save(snap, path));
+    free(path);
+}
+
+/*
+ * Phases let a single audit of a whole build attribute reads to the
+ * targets being made. The command writes a label per line to the FIFO
+ * named by $PMAUDIT_MARKER and waits for a byte on the ".ack" FIFO
+ * beside it, which pmash -m does. At each marker the tree is rescanned:
+ * whatever was read since the last marker, and not written in the
+ * meantime, is a prereq of the phase being closed. Those reads are
+ * carried over to the audit as a whole and their atimes re-primed.
+ */
+static void
+phase_mark(const char *label)
+{
+    const char *marker;
+    char *ack, c;
+    int fd;
+
+    if (!(marker = getenv(MARKER_ENV))) {
+        return;
+    }
+    insist((fd = open(marker, O_WRONLY)) != -1, marker);
+    insist(dprintf(fd, "%s\n", label) != -1, marker);
+    close(fd);
+    insist(asprintf(&ack, "%s.ack", marker) != -1, "asprintf()");
+    insist((fd = open(ack, O_RDONLY)) != -1, ack);
+    insist(read(fd, &c, 1) != -1, ack);
+    close(fd);
+    free(ack);
+}
+
+static void
+phase_add(void *arg, const char *path)
+{
+    (void)arg;
+    if (!cur_phase) {
+        return;
+    }
+    insist((cur_phase->paths = realloc(cur_phase->paths,
+                    (cur_phase->count + 1) * sizeof(char *))) != NULL,
+            "realloc()");
+    cur_phase->paths[cur_phase->count++] = strdup(path);
+}
+
+// Close the current phase and open one for label, if any.
+static void
+phase_start(const char *label)
+{
+    trace_begin("checkpoint");
+    check(pma_checkpoint(snap, phase_add, NULL));
+    trace_end("checkpoint");
+    if (cur_phase) {
+        qsort(cur_phase->paths, cur_phase->count, sizeof(char *), strvcmp);
+        cur_phase = NULL;
+    }
+    if (label && *label) {
+        insist((phases = realloc(phases,
+                        (phase_count + 1) * sizeof(phase_s))) != NULL,
+                "realloc()");
+        cur_phase = &phases[phase_count++];
+        cur_phase->label = strdup(label);
+        cur_phase->paths = NULL;
+        cur_phase->count = 0;
+        if (verbosity > 1) {
+            fprintf(stderr, "%s: phase: %s\n", prog, label);
+        }
+    }
+}
+
+static void
+on_sigchld(int sig)
+{
+    int saved = errno;
+
+    (void)sig;
+    (void)!write(sigchld_pipe[1], "", 1);
+    errno = saved;
+}
+
+// How often to retry an ack whose reader hasn't opened the FIFO yet.
+#define ACK_RETRY_MS 10
+
+/*
+ * Like system() but serves phase markers while the command runs.
+ * Acks are sent without blocking so a marker whose writer died can't
+ * hang us; they're retried from the poll loop until a reader appears.
+ */
+static int
+run_phased(const char *cmdstr)
+{
+    struct sigaction sa, oldchld, oldint, oldquit, oldpipe;
+    struct pollfd pfds[2];
+    char buf[4096], *ack, *nl, c;
+    size_t len = 0, acks = 0;
+    ssize_t n;
+    pid_t pid;
+    int mfd, keepfd, afd, toolong = 0, status = -1;
+
+    insist(asprintf(&markerfile, "%s/marker.%ld", session,
+                (long)getpid()) != -1, "asprintf()");
+    insist(asprintf(&ack, "%s.ack", markerfile) != -1, "asprintf()");
+    insist(mkfifo(markerfile, 0600) != -1, markerfile);
+    insist(mkfifo(ack, 0600) != -1, ack);
+    insist((mfd = open(markerfile, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) != -1,
+            markerfile);
+    // Holding a write end keeps poll() quiet between markers.
+    insist((keepfd = open(markerfile, O_WRONLY | O_CLOEXEC)) != -1,
+            markerfile);
+    insist(pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) != -1, "pipe2()");
+    insist(setenv(MARKER_ENV, markerfile, 1) != -1, MARKER_ENV);
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    insist(sigaction(SIGCHLD, &sa, &oldchld) != -1, "sigaction()");
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = 0;
+    insist(sigaction(SIGINT, &sa, &oldint) != -1, "sigaction()");
+    insist(sigaction(SIGQUIT, &sa, &oldquit) != -1, "sigaction()");
+    // A reader gone between open and write must give EPIPE, not kill us.
+    insist(sigaction(SIGPIPE, &sa, &oldpipe) != -1, "sigaction()");
+
+    insist((pid = fork()) != -1, "fork()");
+    if (pid == 0) {
+        sigaction(SIGCHLD, &oldchld, NULL);
+        sigaction(SIGINT, &oldint, NULL);
+        sigaction(SIGQUIT, &oldquit, NULL);
+        sigaction(SIGPIPE, &oldpipe, NULL);
+        execl("/bin/sh", "sh", "-c", cmdstr, (char *)NULL);
+        _exit(127);
+    }
+
+    pfds[0].fd = mfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = sigchld_pipe[0];
+    pfds[1].events = POLLIN;
+    while (1) {
+        // Opening a FIFO with no reader fails with ENXIO; try later.
+        while (acks > 0 &&
+                (afd = open(ack, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) != -1) {
+            if (write(afd, "\n", 1) == 1) {
+                acks--;
+            } else {
+                insist(errno == EPIPE || errno == EAGAIN, ack);
+            }
+            close(afd);
+        }
+        insist(acks == 0 || errno == ENXIO || errno == EINTR, ack);
+        if (poll(pfds, 2, acks > 0 ? ACK_RETRY_MS : -1) == -1) {
+            insist(errno == EINTR, "poll()");
+            continue;
+        }
+        if ((pfds[0].revents & POLLIN) &&
+                (n = read(mfd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+            len += n;
+            buf[len] = '\0';
+            while ((nl = strchr(buf, '\n'))) {
+                *nl = '\0';
+                if (toolong) {
+                    toolong = 0;
+                } else {
+                    phase_start(buf);
+                }
+                acks++;
+                len -= nl + 1 - buf;
+                memmove(buf, nl + 1, len + 1);
+            }
+            // Reject an over-long label but still ack it when it ends.
+            if (len == sizeof(buf) - 1) {
+                if (!toolong) {
+                    fprintf(stderr, "%s: Warning: phase label over %zu bytes"
+                            " ignored\n", prog, sizeof(buf) - 2);
+                }
+                toolong = 1;
+                len = 0;
+            }
+        }
+        if (pfds[1].revents & POLLIN) {
+            while (read(sigchld_pipe[0], &c, 1) > 0);
+            if (wait4(pid, &status, WNOHANG, &child_ru) == pid) {
+                break;
+            }
+        }
+    }
+    phase_start(NULL);
+
+    sigaction(SIGCHLD, &oldchld, NULL);
+    sigaction(SIGINT, &oldint, NULL);
+    sigaction(SIGQUIT, &oldquit, NULL);
+    sigaction(SIGPIPE, &oldpipe, NULL);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    close(keepfd);
+    close(mfd);
+    (void)unlink(ack);
+    (void)unlink(markerfile);
+    free(ack);
+    return status;
+}
+
+/*
+ * Like system() but keeps the command's resource usage for --stats.
+ */
+static int
+run_command(const char *cmdstr)
+{
+    struct sigaction sa, oldint, oldquit;
+    pid_t pid;
+    int status = -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = SIG_IGN;
+    insist(sigaction(SIGINT, &sa, &oldint) != -1, "sigaction()");
+    insist(sigaction(SIGQUIT, &sa, &oldquit) != -1, "sigaction()");
+
+    insist((pid = fork()) != -1, "fork()");
+    if (pid == 0) {
+        sigaction(SIGINT, &oldint, NULL);
+        sigaction(SIGQUIT, &oldquit, NULL);
+        execl("/bin/sh", "sh", "-c", cmdstr, (char *)NULL);
+        _exit(127);
+    }
+    while (wait4(pid, &status, 0, &child_ru) == -1) {
+        insist(errno == EINTR, "wait4()");
+    }
+
+    sigaction(SIGINT, &oldint, NULL);
+    sigaction(SIGQUIT, &oldquit, NULL);
+    return status;
+}
+
+static size_t
+phases_write(void)
+{
+    size_t i, j, count = 0;
+
+    for (i = 0; i < phase_count; i++) {
+        if (!phases[i].count) {
+            continue;
+        }
+        fprintf(fp, "\n%s:", phases[i].label);
+        for (j = 0; j < phases[i].count; j++) {
+            fprintf(fp, " \\\n  %s", phases[i].paths[j]);
+        }
+        fputc('\n', fp);
+        count += phases[i].count;
+    }
+    return count;
+}
+
+static void
+exec_shell(const char *cmdstr, int eflag)
+{
+    char flags[5] = "-", *f = flags + 1;
+
+    if (eflag) {
+        *f++ = 'e';
+    }
+    if (verbosity || getenv("PMASH_VERBOSITY")) {
+        *f++ = 'x';
+    }
+    *f++ = 'c';
+    *f = '\0';
+    execl("/bin/sh", "sh", flags, cmdstr, (char *)NULL);
+    insist(0, "/bin/sh");
+}
+
+// The target a depsfile describes is its name less the suffix.
+static char *
+deps_target(void)
+{
+    char *target, *dot, *slash;
+
+    if (!depsfile) {
+        return NULL;
+    }
+    insist((target = strdup(depsfile)) != NULL, "strdup()");
+    slash = strrchr(target, '/');
+    if ((dot = strrchr(target, '.')) && (!slash || dot > slash)) {
+        *dot = '\0';
+    }
+    return target;
+}
+
+/*
+ * Decide whether cmd is too trivial to audit. Each line of the rules
+ * file is blank, a # comment, or one of:
+ *
+ *     cmd REGEX           skip commands matching this extended regex
+ *     target GLOB         skip when making a target matching GLOB
+ *     only GLOB[,GLOB]    skip unless making a target matching a GLOB
+ *
+ * The target is taken from the depsfile name. Each cmd pattern is
+ * compiled on its own, so that backreferences within it mean what they
+ * say, and rules are read only until one says to skip.
+ */
+static int
+skip_audit(const char *rulesfile, const char *cmdstr)
+{
+    FILE *f;
+    char *line = NULL, *kw, *arg, *glob, *target = deps_target();
+    char errbuf[256];
+    size_t n = 0;
+    ssize_t len;
+    unsigned lineno = 0;
+    int only = 0, wanted = 0, skip = 0, rc;
+    regex_t re;
+
+    insist((f = fopen(rulesfile, "r")) != NULL, rulesfile);
+    while (!skip && (len = getline(&line, &n, f)) != -1) {
+        lineno++;
+        for (kw = chomp(line, len); isspace((unsigned char)*kw); kw++);
+        if (*kw == '\0' || *kw == '#') {
+            continue;
+        }
+        for (arg = kw; *arg && !isspace((unsigned char)*arg); arg++);
+        if (*arg) {
+            *arg++ = '\0';
+        }
+        while (isspace((unsigned char)*arg)) {
+            arg++;
+        }
+        if (*arg == '\0') {
+            fprintf(stderr, "%s: Error: %s:%u: missing pattern\n",
+                    prog, rulesfile, lineno);
+            exit(EXIT_FAILURE);
+        }
+        if (!strcmp(kw, "cmd")) {
+            if ((rc = regcomp(&re, arg, REG_EXTENDED | REG_NOSUB))) {
+                regerror(rc, &re, errbuf, sizeof(errbuf));
+                fprintf(stderr, "%s: Error: %s:%u: %s\n",
+                        prog, rulesfile, lineno, errbuf);
+                exit(EXIT_FAILURE);
+            }
+            skip = !regexec(&re, cmdstr, 0, NULL, 0);
+            regfree(&re);
+        } else if (!strcmp(kw, "target")) {
+            skip = target && !fnmatch(arg, target, 0);
+        } else if (!strcmp(kw, "only")) {
+            only = 1;
+            for (glob = strtok(arg, ","); glob; glob = strtok(NULL, ",")) {
+                wanted |= target && !fnmatch(glob, target, 0);
+            }
+        } else {
+            fprintf(stderr, "%s: Error: %s:%u: unknown rule '%s'\n",
+                    prog, rulesfile, lineno, kw);
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(f);
+    free(line);
+
+    // With no depsfile there's no target to hold "only" rules against.
+    if (!skip && only && target && !wanted) {
+        skip = 1;
+    }
+    free(target);
+    return skip;
+}
+
+static void
+json_str(FILE *f, const char *str)
+{
+    const unsigned char *c;
+
+    fputc('"', f);
+    for (c = (const unsigned char *)str; c && *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(f, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(f, "\\u%04x", *c);
+        } else {
+            fputc(*c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static uint64_t
+tv_us(const struct timeval *tv)
+{
+    return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/*
+ * Append one JSON line describing this run to statsfile, or stderr.
+ * The line goes out in a single write so concurrent runs sharing a
+ * file don't interleave.
+ */
+static void
+stats_write(const char *statsfile, const char *cmdstr, int rc,
+        const uint64_t *phase_ns)
+{
+    static const char *names[] = {
+        "setup", "probe", "prime", "load", "command", "checkpoint",
+        "rescan", "output", "total"
+    };
+    pma_counters_t ctr;
+    struct rusage self;
+    pma_hash_counters_t hc;
+    pma_stats_t st;
+    char *line, *target;
+    size_t len, i;
+    FILE *f;
+    int fd;
+
+    pma_get_stats(snap, &st);
+    pma_get_counters(snap, &ctr);
+    pma_hasher_get_counters(hasher, &hc);
+    insist(getrusage(RUSAGE_SELF, &self) != -1, "getrusage()");
+    target = deps_target();
+
+    insist((f = open_memstream(&line, &len)) != NULL, "open_memstream()");
+    fprintf(f, "{\"prog\": ");
+    json_str(f, prog);
+    fprintf(f, ", \"pid\": %ld, \"target\": ", (long)getpid());
+    if (target) {
+        json_str(f, target);
+    } else {
+        fputs("null", f);
+    }
+    fputs(", \"cmd\": ", f);
+    json_str(f, cmdstr);
+    fprintf(f, ", \"rc\": %d, \"phases_ns\": {", rc);
+    for (i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        fprintf(f, "%s\"%s\": %llu", i ? ", " : "", names[i],
+                (unsigned long long)phase_ns[i]);
+    }
+    fprintf(f, "}, \"files\": %llu, \"dirs\": %llu, \"stat\": %llu,"
+            " \"utimensat\": %llu, \"open\": %llu, \"snapshot_bytes\": %zu,"
+            " \"peak_rss_kb\": %ld",
+            (unsigned long long)ctr.files, (unsigned long long)ctr.dirs,
+            (unsigned long long)ctr.stats, (unsigned long long)ctr.utimes,
+            (unsigned long long)ctr.opens, ctr.memory, self.ru_maxrss);
+    fprintf(f, ", \"child\": {\"utime_us\": %llu, \"stime_us\": %llu,"
+            " \"maxrss_kb\": %ld, \"minflt\": %ld, \"majflt\": %ld,"
+            " \"inblock\": %ld, \"oublock\": %ld, \"nvcsw\": %ld,"
+            " \"nivcsw\": %ld}",
+            (unsigned long long)tv_us(&child_ru.ru_utime),
+            (unsigned long long)tv_us(&child_ru.ru_stime),
+            child_ru.ru_maxrss, child_ru.ru_minflt, child_ru.ru_majflt,
+            child_ru.ru_inblock, child_ru.ru_oublock, child_ru.ru_nvcsw,
+            child_ru.ru_nivcsw);
+    fprintf(f, ", \"prereqs\": %u, \"outputs\": %u, \"cascades_avoided\": %u,"
+            " \"hashed_files\": %llu, \"hashed_bytes\": %llu,"
+            " \"hash_cache_hits\": %llu, \"hash_mb_per_sec\": %.1f,"
+            " \"ambiguous\": %u, \"changed_in_granule\": %u}\n",
+            prq_count, out_count, restat_count,
+            (unsigned long long)hc.files, (unsigned long long)hc.bytes,
+            (unsigned long long)hc.hits,
+            hc.nsecs ? hc.bytes * 1e3 / hc.nsecs : 0.0,
+            st.ambiguous, st.changed);
+    insist(fclose(f) != EOF, "open_memstream()");
+
+    if (statsfile) {
+        insist((fd = open(statsfile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0644)) != -1, statsfile);
+    } else {
+        fd = STDERR_FILENO;
+    }
+    insist(write(fd, line, len) == (ssize_t)len, statsfile ? statsfile : "stderr");
+    if (statsfile) {
+        close(fd);
+    }
+    free(line);
+    free(target);
 }
 
 int
@@ -251,7 +1528,22 @@ main(int argc, char *argv[])
     char *path;
     char *p;
     char *cmdstr = NULL, *watchdirs = ".";
-    int eflag = 0;
+    char *memofile = NULL, *outfile = NULL, *restatfile = NULL;
+    char *marklabel = NULL, *skipfile = NULL, *statsfile = NULL, *target;
+    char *tracefile = NULL;
+    const char *hashalgo = "vh128";
+    uint64_t start_ns = monotonic_ns(), mark_ns = 0;
+    uint64_t phase_ns[9] = {0};
+    uint64_t memokey = 0;
+    int eflag = 0, pflag = 0, sflag = 0;
+    unsigned snapflags = 0;
+    size_t budget = 0;
+    size_t phase_prqs = 0, cursor;
+    long nthreads;
+    int cached = -1, loaded = 0, spilled = 0, count, status = 0;
+    pma_hooks_t hooks;
+    pma_stats_t st;
+    pma_diff_t d;
     int rc = EXIT_SUCCESS;
 
     prog = strrchr(argv[0], '/');
@@ -268,6 +1560,15 @@ main(int argc, char *argv[])
             case 'h':
                 usage(EXIT_SUCCESS);
                 break;
+            case 'A':
+                hashalgo = optarg;
+                break;
+            case 'B':
+                budget = parse_size(optarg);
+                break;
+            case 'C':
+                cachedir = optarg;
+                break;
             case 'c':
                 cmdstr = optarg;
                 break;
@@ -277,18 +1578,103 @@ main(int argc, char *argv[])
             case 'e':
                 eflag++;
                 break;
+            case 'H':
+                hflag++;
+                break;
+            case 'I':
+                snapflags |= PMA_COLDCACHE;
+                break;
+            case 'L':
+                cachelink = 1;
+                break;
+            case 'K':
+                fprintfile = optarg;
+                break;
+            case 'M':
+                memofile = optarg;
+                break;
+            case 'm':
+                marklabel = optarg;
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 'p':
+                pflag++;
+                break;
+            case 'R':
+                restatfile = optarg;
+                break;
+            case 'S':
+                sflag++;
+                statsfile = optarg;
+                break;
+            case 't':
+                tracefile = optarg;
+                break;
             case 'V':
                 verbosity++;
                 break;
             case 'W':
                 watchdirs = optarg;
                 break;
+            case 'X':
+                skipfile = optarg;
+                break;
+        }
+    }
+
+    // As a marker client pmash audits nothing itself.
+    if (marklabel) {
+        phase_mark(marklabel);
+        if (!cmdstr) {
+            return EXIT_SUCCESS;
         }
+        session_drop();
+        exec_shell(cmdstr, eflag);
     }
 
     if (!cmdstr) {
         usage(EXIT_FAILURE);
     }
+    if (!(hasher = pma_hasher_new(hashalgo))) {
+        insist(errno == EINVAL, "pma_hasher_new()");
+        usage(EXIT_FAILURE);
+    }
+
+    if (!skipfile && (p = getenv("PMASH_SKIP_RULES")) && *p) {
+        skipfile = p;
+    }
+    if (skipfile && skip_audit(skipfile, cmdstr)) {
+        if (verbosity > 1) {
+            fprintf(stderr, "%s: not auditing: %s\n", prog, cmdstr);
+        }
+        session_drop();
+        exec_shell(cmdstr, eflag);
+    }
+
+    if (tracefile || ((tracefile = getenv("PMASH_TRACE")) && *tracefile)) {
+        insist((trace_fd = open(tracefile,
+                        O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) != -1,
+                tracefile);
+        if (!(trace_target = deps_target())) {
+            trace_target = cmdstr;
+        }
+        trace_event('B', "pmash", start_ns);
+        atexit(trace_exit);
+    }
+
+    if ((p = getenv("PMASH_HASH_THREADS"))) {
+        nthreads = atol(p);
+    } else {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    pma_hasher_set_threads(hasher, nthreads < 1 ? 1 : nthreads);
+
+    if (fprintfile || (fprintfile = getenv("PMASH_HASH_CACHE"))) {
+        insist(pma_hasher_cache(hasher, fprintfile) != -1, fprintfile);
+        atexit(hash_save);
+    }
 
     /*
      * It's hard to see how this could ever work in parallel builds
@@ -302,6 +1688,79 @@ main(int argc, char *argv[])
         }
     }
 
+    insist((snap = pma_snapshot_new()) != NULL, "pma_snapshot_new()");
+    if (!budget && (p = getenv("PMASH_MEMORY_BUDGET")) && *p) {
+        budget = parse_size(p);
+    }
+    if ((p = getenv("PMASH_COLD_CACHE")) && *p && strcmp(p, "0")) {
+        snapflags |= PMA_COLDCACHE;
+    }
+    if ((p = getenv("PMASH_CACHE_LINK")) && *p && strcmp(p, "0")) {
+        cachelink = 1;
+    }
+    pma_set_flags(snap, snapflags);
+    // Version control metadata and editor swap files aren't prereqs.
+    check(pma_exclude(snap, ".git"));
+    check(pma_exclude(snap, ".svn"));
+    check(pma_exclude(snap, "*.swp"));
+    // Nor are our own files, which change after the audit is over.
+    exclude_own(depsfile);
+    exclude_own(statsfile);
+    exclude_own(tracefile);
+    exclude_own(fprintfile);
+    for (path = strtok(strdup(watchdirs), ","); path;
+            path = strtok(NULL, ",")) {
+        check(pma_watch(snap, path));
+    }
+    if ((p = getenv("PMASH_TIMESTAMP_GRANULARITY"))) {
+        pma_set_granularity(snap, atol(p));
+    }
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.size = sizeof(hooks);
+    hooks.arg = hasher;
+    hooks.hash = pma_hasher_hook;
+    hooks.report = session_report;
+    hooks.retimed = pma_hasher_retimed;
+    check(pma_set_hooks(snap, &hooks));
+
+    memokey = memo_key(cmdstr, watchdirs);
+
+    if (memofile) {
+        if (memo_check(memofile, memokey)) {
+            if (verbosity || getenv("PMASH_VERBOSITY")) {
+                fprintf(stderr, "%s: skipping, inputs unchanged since %s\n",
+                        prog, memofile);
+            }
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (cachedir && (cached = cache_fetch(memokey)) >= 0) {
+        session_drop();
+        if (verbosity || getenv("PMASH_VERBOSITY")) {
+            fprintf(stderr, "%s: restored %d outputs from %s\n",
+                    prog, cached, cachedir);
+        }
+    }
+
+    mark_ns = monotonic_ns();
+    phase_ns[0] = mark_ns - start_ns;
+    trace_event('B', "setup", start_ns);
+    trace_event('E', "setup", mark_ns);
+    if (cached < 0) {
+        session_begin();
+        if (!session_owner) {
+            pma_set_flags(snap, snapflags | PMA_NESTED);
+            path = session_path("snapshot");
+            trace_begin("load");
+            check(loaded = pma_load(snap, path));
+            trace_end("load");
+            free(path);
+        }
+    }
+
+    // Creating the depsfile would make the snapshot look out of date,
+    // so it waits until the snapshot is loaded.
     if (depsfile) {
         if ((fp = fopen(depsfile, "w")) == NULL) {
             fprintf(stderr, "%s: Warning: skipping %s: %s\n",
@@ -312,38 +1771,36 @@ main(int argc, char *argv[])
         fp = stdout;
     }
 
-    for (path = strtok(strdup(watchdirs), ","); path; path = strtok(NULL, ",")) {
-        char *tmpf;
-        char buf[] = {"data\n"};
-        struct stat ostats, nstats;
-        struct timespec otimes[2] = {{-1, 0L}, {0, UTIME_OMIT}};
-        int fd;
-
-        /*
-         * Create, read, and remove a temp file to check that
-         * atimes are being updated.
-         */
-        insist((asprintf(&tmpf, "%s/audit.%ld.tmp", path,
-                        (long)getpid())) != -1, "asprintf()");
-        insist((fd = open(tmpf, O_CREAT|O_WRONLY|O_EXCL, 0644)) != -1, tmpf);
-        insist(write(fd, buf, strlen(buf)) != -1, tmpf);
-        insist(fstat(fd, &ostats) != -1, tmpf);
-        otimes[0].tv_sec = ostats.st_mtime - 1;
-        insist(futimens(fd, otimes) != -1, tmpf);
-        insist(close(fd) != -1, tmpf);
-        insist((fd = open(tmpf, O_RDONLY)) != -1, tmpf);
-        insist(read(fd, buf, sizeof(buf)) != -1, tmpf);
-        insist(close(fd) != -1, tmpf);
-        insist(stat(tmpf, &nstats) != -1, tmpf);
-        insist(unlink(tmpf) != -1, tmpf);
-        (void)free(tmpf);
-        if (nstats.st_atime < nstats.st_mtime ||
-                (nstats.st_atime == nstats.st_mtime &&
-                 nstats.st_atim.tv_nsec < nstats.st_mtim.tv_nsec)) {
-            die("atimes not updated here");
-        }
-
-        insist(nftw(path, nftw_pre_callback, NOPENFD, FTW_MOUNT) != -1, path);
+    if (cached < 0) {
+        if (loaded) {
+            if (verbosity > 1) {
+                fprintf(stderr, "%s: using snapshot from %s\n", prog, session);
+            }
+        } else {
+            pma_counters_t ctr;
+
+            mark_ns = monotonic_ns();
+            // Phases need checkpoints and a nested audit hands its
+            // snapshot back; neither works from spilled runs.
+            if ((spilled = budget && session_owner && !pflag)) {
+                check(pma_set_budget(snap, budget));
+            }
+            check(pma_prime(snap));
+            // Nested audits can start from the tree as primed.
+            if (session_owner && !spilled) {
+                path = session_path("snapshot");
+                check(pma_save(snap, path));
+                free(path);
+            }
+            // Probing comes first within pma_prime().
+            pma_get_counters(snap, &ctr);
+            trace_event('B', "prime", mark_ns);
+            trace_event('B', "probe", mark_ns);
+            trace_event('E', "probe", mark_ns + ctr.probe_ns);
+            trace_end("prime");
+        }
+        pma_get_stats(snap, &st);
+        pma_hasher_set_granularity(hasher, st.granularity);
     }
 
     if (verbosity || getenv("PMASH_VERBOSITY")) {
@@ -372,32 +1829,91 @@ main(int argc, char *argv[])
         insist(asprintf(&cmdstr, "set -e; %s", cmdstr) != -1, "asprintf()");
     }
 
-    if (system(cmdstr)) {
-        rc = EXIT_FAILURE;
+    if (cached < 0) {
+        session_mark_log();
+        mark_ns = monotonic_ns();
+        trace_event('B', "command", mark_ns);
+        if ((status = pflag ? run_phased(cmdstr) : run_command(cmdstr))) {
+            rc = EXIT_FAILURE;
+        }
+        trace_end("command");
+        phase_ns[4] = monotonic_ns() - mark_ns;
+
+        trace_begin("rescan");
+        session_reads();
+        check(pma_rescan(snap));
+        trace_end("rescan");
+        for (cursor = 0; verbosity > 1 && pma_diff_next(snap, &cursor, &d); ) {
+            if (d.flags & PMA_DIFF_CHANGED) {
+                fprintf(stderr, "%s: modified within timestamp"
+                        " granularity: %s\n", prog, d.path);
+            }
+        }
+
+        if (cachedir && rc == EXIT_SUCCESS) {
+            cache_store(memokey);
+        }
     }
+    mark_ns = monotonic_ns();
+    trace_event('B', "output", mark_ns);
 
-    if (!fp) {
-        return rc;
+    if (outfile) {
+        insist((auxfp = fopen(outfile, "w")) != NULL, outfile);
+        outputs_write(auxfp);
+        insist(fclose(auxfp) != EOF, outfile);
+    } else if (sflag) {
+        outputs_write(NULL);
     }
 
-    for (path = strtok(strdup(watchdirs), ","); path; path = strtok(NULL, ",")) {
-        insist(nftw(path, nftw_post_callback, NOPENFD, FTW_MOUNT) != -1, path);
+    if (restatfile && rc == EXIT_SUCCESS) {
+        restat(restatfile);
     }
 
-    twalk(tree2, post_walk_1);
-    fputc('\n', fp);
+    target = deps_target();
+    check(count = pma_write_deps(snap, fp, target));
+    prq_count = count;
+    free(target);
     if (depsfile) {
-        twalk(tree2, post_walk_2);
+        phase_prqs = phases_write();
+    }
+
+    if (memofile) {
+        if (rc == EXIT_SUCCESS) {
+            memo_save(memofile, memokey);
+        } else if (unlink(memofile) == -1 && errno != ENOENT) {
+            insist(0, memofile);
+        }
     }
 
     if (depsfile) {
         fclose(fp);
         // Don't keep empty deps files around.
-        if (!prq_count) {
+        if (!prq_count && !phase_prqs) {
             insist(unlink(depsfile) != -1, depsfile);
         }
     }
 
+    if (session && !session_owner) {
+        session_handback();
+    }
+    trace_end("output");
+
+    if (sflag) {
+        pma_counters_t ctr;
+
+        pma_get_counters(snap, &ctr);
+        phase_ns[1] = ctr.probe_ns;
+        phase_ns[2] = ctr.prime_ns;
+        phase_ns[3] = ctr.load_ns;
+        phase_ns[5] = ctr.checkpoint_ns;
+        phase_ns[6] = ctr.rescan_ns;
+        phase_ns[7] = monotonic_ns() - mark_ns;
+        phase_ns[8] = monotonic_ns() - start_ns;
+        stats_write(statsfile, cmdstr,
+                WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+                phase_ns);
+    }
+
     return rc;
 }
 
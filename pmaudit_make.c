@@ -0,0 +1,279 @@
+/******************************************************************************
+ * Copyright (C) 2010-2018 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * A GNU make loadable object which audits recipes within make itself:
+ *
+ *     load pmaudit.so
+ *
+ * make expands .SHELLFLAGS in the context of the target just before
+ * running each recipe line, so loading this prefixes .SHELLFLAGS with
+ * "$(pmaudit $@)". When the target named changes the tree is checked:
+ * whatever was read since the previous target's first line, and not
+ * written since, is a prereq of that target and is written to its
+ * deps file. All lines of a recipe count toward its target without
+ * .ONESHELL, and no process is spawned beyond make's own shells.
+ *
+ * These variables, if set before the load, are read by it:
+ *
+ *     PMAUDIT_WATCH       directories to monitor (default '.')
+ *     PMAUDIT_SUFFIX      appended to a target to name its deps file
+ *                         (default '.d')
+ *     PMAUDIT_COLD_CACHE  if nonempty, scan in inode order
+ *
+ * Sub-makes loading it again leave the auditing to the outermost make,
+ * which charges everything a sub-make does to the target running it.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <gnumake.h>
+
+#include "libpmaudit.h"
+
+#define NEST_ENV "PMAUDIT_MAKE"
+#define SESSION_ENV "PMAUDIT_SESSION"
+
+int plugin_is_GPL_compatible;
+
+static const char *prog = "pmaudit.so";
+
+static pma_snapshot_t *snap;
+static pma_hasher_t *hasher;
+static char *suffix;
+static char *cur_target;
+static char **prereqs;
+static size_t prq_count;
+static FILE *reportfp;
+static pid_t make_pid;
+
+static void
+die(const char *msg)
+{
+    fprintf(stderr, "%s: Error: %s\n", prog, msg);
+    exit(EXIT_FAILURE);
+}
+
+static void
+insist(int success, const char *term)
+{
+    if (!success) {
+        fprintf(stderr, "%s: Error: %s: %s\n", prog, term, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void
+check(int rc)
+{
+    if (rc == -1) {
+        die(pma_error(snap));
+    }
+}
+
+static int
+strvcmp(const void *pa, const void *pb)
+{
+    return strcmp(*(char *const *)pa, *(char *const *)pb);
+}
+
+// Tell an enclosing pmaudit or pmash about a read before re-priming.
+static void
+session_report(void *arg, const char *abspath)
+{
+    char *log;
+
+    (void)arg;
+    if (!reportfp) {
+        insist(asprintf(&log, "%s/touched", getenv(SESSION_ENV)) != -1,
+                "asprintf()");
+        insist((reportfp = fopen(log, "a")) != NULL, log);
+        setvbuf(reportfp, NULL, _IOLBF, 0);
+        free(log);
+    }
+    fprintf(reportfp, "R %s\n", abspath);
+}
+
+static void
+prereq_add(void *arg, const char *path)
+{
+    (void)arg;
+    insist((prereqs = realloc(prereqs,
+                    (prq_count + 1) * sizeof(char *))) != NULL, "realloc()");
+    insist((prereqs[prq_count++] = strdup(path)) != NULL, "strdup()");
+}
+
+// Charge what was read since the current target began to it.
+static void
+target_finish(void)
+{
+    char *depsfile;
+    size_t i;
+    FILE *fp;
+
+    check(pma_checkpoint(snap, prereq_add, NULL));
+    insist(asprintf(&depsfile, "%s%s", cur_target, suffix) != -1,
+            "asprintf()");
+    if (prq_count) {
+        qsort(prereqs, prq_count, sizeof(char *), strvcmp);
+        insist((fp = fopen(depsfile, "w")) != NULL, depsfile);
+        fprintf(fp, "%s:", cur_target);
+        for (i = 0; i < prq_count; i++) {
+            fprintf(fp, " \\\n  %s", prereqs[i]);
+        }
+        fputc('\n', fp);
+        for (i = 0; i < prq_count; i++) {
+            fprintf(fp, "\n%s:\n", prereqs[i]);
+            free(prereqs[i]);
+        }
+        insist(fclose(fp) != EOF, depsfile);
+    } else if (unlink(depsfile) == -1 && errno != ENOENT) {
+        // Don't keep stale deps files around.
+        insist(0, depsfile);
+    }
+    free(depsfile);
+    free(cur_target);
+    cur_target = NULL;
+    prq_count = 0;
+}
+
+static void
+audit_end(void)
+{
+    // Children of make that exit without exec'ing have nothing to say.
+    if (getpid() == make_pid && cur_target) {
+        target_finish();
+    }
+}
+
+/*
+ * Returns 1 if make was asked for a dry run, or dies if for a parallel
+ * one: there's no telling which of several running recipes read a file.
+ * This is checked when the first recipe runs since -j doesn't appear
+ * in MAKEFLAGS until makefiles have been read.
+ */
+static int
+check_makeflags(void)
+{
+    char *flags, *eq, *jf;
+    size_t len;
+    int dry;
+
+    flags = gmk_expand("$(MAKEFLAGS)");
+    eq = strchr(flags, '=');
+    jf = strstr(flags, " -j");
+    if (jf && (!eq || jf < eq)) {
+        die("not supported in -j mode");
+    }
+    // Single-letter flags come first, with no leading '-'.
+    len = strcspn(flags, " ");
+    dry = flags[0] != '-' && memchr(flags, 'n', len) != NULL;
+    gmk_free(flags);
+    return dry;
+}
+
+static char *
+func_pmaudit(const char *nm, unsigned int argc, char **argv)
+{
+    const char *target = argv[0];
+
+    (void)nm;
+    (void)argc;
+    if (!snap || !*target || (cur_target && !strcmp(cur_target, target))) {
+        return NULL;
+    }
+    if (cur_target) {
+        target_finish();
+    } else if (check_makeflags()) {
+        pma_snapshot_free(snap);
+        snap = NULL;
+        return NULL;
+    } else {
+        // Prime as late as possible so reading makefiles isn't charged.
+        check(pma_prime(snap));
+    }
+    insist((cur_target = strdup(target)) != NULL, "strdup()");
+    return NULL;
+}
+
+int
+pmaudit_gmk_setup(const gmk_floc *floc)
+{
+    char *watchdirs, *dirs, *path, *shellflags, *buf;
+    unsigned flags = 0;
+    pma_hooks_t hooks;
+
+    gmk_add_function("pmaudit", func_pmaudit, 1, 1, GMK_FUNC_DEFAULT);
+    if (getenv(NEST_ENV)) {
+        return 1;
+    }
+    // Recipes get their environment from make's exported variables.
+    gmk_eval("export " NEST_ENV " := 1", floc);
+
+    insist((snap = pma_snapshot_new()) != NULL, "pma_snapshot_new()");
+    // As with pmash, skip VCS metadata and editor swap files.
+    check(pma_exclude(snap, ".git"));
+    check(pma_exclude(snap, ".svn"));
+    check(pma_exclude(snap, "*.swp"));
+    watchdirs = gmk_expand("$(or $(PMAUDIT_WATCH),.)");
+    insist((dirs = strdup(watchdirs)) != NULL, "strdup()");
+    for (path = strtok(dirs, ", "); path; path = strtok(NULL, ", ")) {
+        check(pma_watch(snap, path));
+    }
+    free(dirs);
+    gmk_free(watchdirs);
+    buf = gmk_expand("$(or $(PMAUDIT_SUFFIX),.d)");
+    insist((suffix = strdup(buf)) != NULL, "strdup()");
+    gmk_free(buf);
+    buf = gmk_expand("$(PMAUDIT_COLD_CACHE)");
+    if (*buf) {
+        flags |= PMA_COLDCACHE;
+    }
+    gmk_free(buf);
+
+    // Hash files whose times can't tell if they changed, as pmash does.
+    insist((hasher = pma_hasher_new("vh128")) != NULL, "pma_hasher_new()");
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.size = sizeof(hooks);
+    hooks.arg = hasher;
+    hooks.hash = pma_hasher_hook;
+    // Inside an audit by pmaudit or pmash, behave as a nested audit.
+    if (getenv(SESSION_ENV)) {
+        hooks.report = session_report;
+        flags |= PMA_NESTED;
+    }
+    check(pma_set_hooks(snap, &hooks));
+    pma_set_flags(snap, flags);
+
+    shellflags = gmk_expand("$(value .SHELLFLAGS)");
+    insist(asprintf(&buf, ".SHELLFLAGS = $(pmaudit $@)%s", shellflags) != -1,
+            "asprintf()");
+    gmk_eval(buf, floc);
+    free(buf);
+    gmk_free(shellflags);
+
+    make_pid = getpid();
+    atexit(audit_end);
+    return 1;
+}
+
+// vim: ts=8:sw=4:tw=80:et:
@@ -0,0 +1,224 @@
+/******************************************************************************
+ * Copyright (C) 2010-2018 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Checks of the audit engine over pma_memfs, run by "make check".
+ *
+ * Under relatime and strictatime a few files are read, written, written
+ * then read, left alone or created between prime and rescan, and each
+ * must come out in its category; under noatime priming must refuse.
+ * Then a nested audit must take the snapshot handed on to it only while
+ * it is current: not once a file in it has been read, nor once a file
+ * has been added beside them.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../libpmaudit.h"
+
+typedef struct {
+    const char *path;
+    pma_category_t category;
+} expect_t;
+
+static const expect_t expected[] = {
+    {"src/idle.h", PMA_UNUSED},
+    {"src/read.c", PMA_PREREQ},
+    {"src/write.o", PMA_FINAL},
+    {"src/tmp.i", PMA_INTERMEDIATE},
+    {"src/new.o", PMA_FINAL},
+    {"src/newtmp.i", PMA_INTERMEDIATE},
+};
+
+static const char *prog = "memfscheck";
+static int failures;
+
+static void
+insist(int success, const char *term)
+{
+    if (!success) {
+        fprintf(stderr, "%s: Error: %s: %s\n", prog, term, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void
+expect(int success, const char *what, const char *detail)
+{
+    if (!success) {
+        fprintf(stderr, "%s: FAIL: %s: %s\n", prog, what, detail);
+        failures++;
+    }
+}
+
+// A tree of the given files, aged as a checkout would be.
+static pma_memfs_t *
+tree(pma_atime_t mode, const char **paths, size_t npaths)
+{
+    pma_memfs_t *m;
+    size_t i;
+
+    insist((m = pma_memfs_new(mode, 1)) != NULL, "pma_memfs_new()");
+    for (i = 0; i < npaths; i++) {
+        insist(pma_memfs_write(m, paths[i], 100) != -1, paths[i]);
+    }
+    pma_memfs_advance(m, 2000000000L);
+    return m;
+}
+
+static pma_snapshot_t *
+snapshot(pma_memfs_t *m, unsigned flags)
+{
+    pma_snapshot_t *s;
+    pma_hooks_t hooks;
+    pma_fsops_t ops;
+
+    insist((s = pma_snapshot_new()) != NULL, "pma_snapshot_new()");
+    pma_memfs_fsops(m, &ops);
+    insist(pma_set_fsops(s, &ops) != -1, pma_error(s));
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.size = sizeof(hooks);
+    hooks.arg = m;
+    hooks.hash = pma_memfs_hash;
+    insist(pma_set_hooks(s, &hooks) != -1, pma_error(s));
+    pma_set_flags(s, flags);
+    insist(pma_watch(s, ".") != -1, pma_error(s));
+    return s;
+}
+
+static void
+check_mode(const char *name, pma_atime_t mode)
+{
+    static const char *before[] = {
+        "src/idle.h", "src/read.c", "src/write.o", "src/tmp.i"
+    };
+    size_t n = sizeof(expected) / sizeof(*expected), cursor, i, found = 0;
+    pma_snapshot_t *s;
+    pma_memfs_t *m;
+    pma_diff_t d;
+    char what[64];
+
+    snprintf(what, sizeof(what), "%s", name);
+    m = tree(mode, before, sizeof(before) / sizeof(*before));
+    s = snapshot(m, 0);
+    if (mode == PMA_NOATIME) {
+        // Reads can't be seen, so the audit mustn't go ahead.
+        expect(pma_prime(s) == -1, what, "primed without atime updates");
+        pma_snapshot_free(s);
+        pma_memfs_free(m);
+        return;
+    }
+    insist(pma_prime(s) != -1, pma_error(s));
+
+    insist(pma_memfs_read(m, "src/read.c") != -1, "src/read.c");
+    insist(pma_memfs_write(m, "src/write.o", 200) != -1, "src/write.o");
+    insist(pma_memfs_write(m, "src/tmp.i", 200) != -1, "src/tmp.i");
+    insist(pma_memfs_read(m, "src/tmp.i") != -1, "src/tmp.i");
+    insist(pma_memfs_write(m, "src/new.o", 300) != -1, "src/new.o");
+    insist(pma_memfs_write(m, "src/newtmp.i", 300) != -1, "src/newtmp.i");
+    insist(pma_memfs_read(m, "src/newtmp.i") != -1, "src/newtmp.i");
+
+    insist(pma_rescan(s) != -1, pma_error(s));
+    for (cursor = 0; pma_diff_next(s, &cursor, &d); ) {
+        for (i = 0; i < n && strcmp(expected[i].path, d.path); i++);
+        if (i == n) {
+            expect(0, what, d.path);
+        } else {
+            expect(d.category == expected[i].category, what, d.path);
+            found++;
+        }
+    }
+    expect(found == n, what, "files missing from the diff");
+    pma_snapshot_free(s);
+    pma_memfs_free(m);
+}
+
+// Prime the tree afresh and leave the snapshot in file.
+static void
+hand_on(pma_memfs_t *m, const char *file)
+{
+    pma_snapshot_t *s = snapshot(m, 0);
+
+    insist(pma_prime(s) != -1, pma_error(s));
+    insist(pma_save(s, file) != -1, pma_error(s));
+    pma_snapshot_free(s);
+}
+
+// Whether a nested audit starting now would take the snapshot in file.
+static int
+loads(pma_memfs_t *m, const char *file)
+{
+    pma_snapshot_t *s = snapshot(m, PMA_NESTED);
+    int rc;
+
+    insist((rc = pma_load(s, file)) != -1, pma_error(s));
+    pma_snapshot_free(s);
+    return rc;
+}
+
+static void
+check_nested(void)
+{
+    static const char *before[] = {"src/a.c", "src/b.c", "lib/c.h"};
+    const char *tmpdir;
+    char *file;
+    pma_memfs_t *m;
+    int fd;
+
+    if (!(tmpdir = getenv("TMPDIR"))) {
+        tmpdir = "/tmp";
+    }
+    insist(asprintf(&file, "%s/memfscheck.XXXXXX", tmpdir) != -1, "asprintf()");
+    insist((fd = mkstemp(file)) != -1, file);
+    close(fd);
+    m = tree(PMA_RELATIME, before, sizeof(before) / sizeof(*before));
+
+    hand_on(m, file);
+    expect(loads(m, file) == 1, "nested", "current snapshot not taken");
+    insist(pma_memfs_read(m, "src/b.c") != -1, "src/b.c");
+    expect(loads(m, file) == 0, "nested", "taken after an unaudited read");
+
+    hand_on(m, file);
+    insist(pma_memfs_write(m, "lib/d.h", 100) != -1, "lib/d.h");
+    expect(loads(m, file) == 0, "nested", "taken after an unaudited create");
+
+    pma_memfs_free(m);
+    (void)unlink(file);
+    free(file);
+}
+
+int
+main(void)
+{
+    check_mode("relatime", PMA_RELATIME);
+    check_mode("strictatime", PMA_STRICTATIME);
+    check_mode("noatime", PMA_NOATIME);
+    check_nested();
+    if (failures) {
+        fprintf(stderr, "%s: %d checks failed\n", prog, failures);
+        return EXIT_FAILURE;
+    }
+    printf("%s: all passed\n", prog);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=8:sw=4:tw=80:et: